@@ -0,0 +1,151 @@
+#!/bin/sh
+# Benchmark fatmod's commands against synthetic images built by mkfatimg.
+#
+# Every combination of image size, cluster size, file count and
+# fragmentation gets a
+# fresh image; each workload is timed and its --stats=json counters summed.
+# Results go to bench_results.csv and bench_results.json.
+#
+# Knobs (environment):
+#   BENCH_SIZES    image sizes in MiB            (default "128 512")
+#   BENCH_FILES    files per image               (default "100 1000")
+#   BENCH_FRAG     extents per file              (default "1 16")
+#   BENCH_SPC      sectors per cluster           (default "2 64")
+#   BENCH_FILE_KB  size of every file in KiB     (default 32)
+#   BENCH_OPS      operations per workload       (default 50)
+#   BENCH_FLAGS    extra global fatmod options, e.g. "--mmap"
+
+FATMOD=${FATMOD:-./fatmod}
+MKFATIMG=${MKFATIMG:-./mkfatimg}
+SIZES=${BENCH_SIZES:-"128 512"}
+FILES=${BENCH_FILES:-"100 1000"}
+FRAGS=${BENCH_FRAG:-"1 16"}
+SPCS=${BENCH_SPC:-"2 64"}
+FILE_KB=${BENCH_FILE_KB:-32}
+OPS=${BENCH_OPS:-50}
+FLAGS=${BENCH_FLAGS:-}
+CSV=${BENCH_CSV:-bench_results.csv}
+JSON=${BENCH_JSON:-bench_results.json}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/fatbench.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT INT TERM
+IMG=$WORK/bench.img
+STATS=$WORK/stats
+
+now() {
+    date +%s.%N
+}
+
+# Run fatmod with --stats=json, discarding stdout and appending the report
+fat() {
+    $FATMOD "$IMG" $FLAGS --stats=json "$@" >/dev/null 2>>"$STATS"
+}
+
+COUNTERS="sector_reads sector_writes bytes_read bytes_written fsyncs fat_lookups fat_updates cache_hits cache_misses allocations alloc_scanned"
+
+# Append one result row: workload ops bytes start end
+record() {
+    awk -v w="$1" -v ops="$2" -v bytes="$3" -v t0="$4" -v t1="$5" \
+        -v mb="$size" -v spc="$spc" -v files="$files" -v frag="$frag" -v counters="$COUNTERS" '
+        BEGIN { n = split(counters, key, " ") }
+        /^\{"sector_reads"/ {
+            for (i = 1; i <= n; i++) {
+                if (match($0, "\"" key[i] "\": [0-9]+")) {
+                    field = substr($0, RSTART, RLENGTH)
+                    sub(/.*: /, "", field)
+                    sum[key[i]] += field
+                }
+            }
+            if (match($0, "\"fsync\": \\{[^}]*\"total\": [0-9]+")) {
+                field = substr($0, RSTART, RLENGTH)
+                sub(/.*: /, "", field)
+                fsync_ns += field
+            }
+        }
+        END {
+            secs = t1 - t0
+            if (secs <= 0) secs = 1e-9
+            printf "%s,%d,%d,%d,%d,%d,%.4f,%.1f,%.2f", w, mb, spc * 512, files, frag, ops, secs,
+                   ops / secs, bytes / 1048576 / secs
+            for (i = 1; i <= n; i++) printf ",%d", sum[key[i]]
+            printf ",%.3f\n", fsync_ns / 1e6
+        }' "$STATS" >>"$CSV"
+    : >"$STATS"
+}
+
+name_of() {
+    printf 'F%07d.DAT' "$1"
+}
+
+echo "workload,image_mb,cluster_bytes,files,extents,ops,seconds,ops_per_sec,mb_per_sec,$(echo $COUNTERS | tr ' ' ,),fsync_ms" >"$CSV"
+
+for size in $SIZES; do
+  for spc in $SPCS; do
+    for files in $FILES; do
+        for frag in $FRAGS; do
+            if ! $MKFATIMG -s "$spc" -n "$files" -z $((FILE_KB * 1024)) -f "$frag" "$IMG" "$size" >&2; then
+                echo "skipping ${size}MiB/$((spc / 2))K clusters/${files} files/${frag} extents: does not fit" >&2
+                continue
+            fi
+            echo "bench: ${size}MiB, $((spc / 2))K clusters, $files files, $frag extents/file" >&2
+            : >"$STATS"
+            n=$OPS
+            [ "$n" -gt "$files" ] && n=$files
+            bytes=$((n * FILE_KB * 1024))
+
+            t0=$(now)
+            i=0
+            while [ $i -lt "$OPS" ]; do fat -l; i=$((i + 1)); done
+            record list "$OPS" 0 "$t0" "$(now)"
+
+            for mode in raw a b; do
+                t0=$(now)
+                i=1
+                while [ $i -le $n ]; do fat -r -$mode "$(name_of $i)"; i=$((i + 1)); done
+                record "read_$mode" $n $bytes "$t0" "$(now)"
+            done
+
+            # Create, write and delete go through one batch script each so
+            # the numbers measure the commands rather than process startup
+            script=$WORK/script
+            : >"$script"
+            i=1
+            while [ $i -le "$OPS" ]; do echo "-c NEW$i.TXT" >>"$script"; i=$((i + 1)); done
+            t0=$(now)
+            fat -b "$script"
+            record create "$OPS" 0 "$t0" "$(now)"
+
+            : >"$script"
+            i=1
+            while [ $i -le "$OPS" ]; do
+                echo "-w NEW$i.TXT 0 $((FILE_KB * 1024)) 65" >>"$script"
+                i=$((i + 1))
+            done
+            t0=$(now)
+            fat -b "$script"
+            record write "$OPS" $((OPS * FILE_KB * 1024)) "$t0" "$(now)"
+
+            : >"$script"
+            i=1
+            while [ $i -le "$OPS" ]; do echo "-d NEW$i.TXT" >>"$script"; i=$((i + 1)); done
+            t0=$(now)
+            fat -b "$script"
+            record delete "$OPS" 0 "$t0" "$(now)"
+        done
+    done
+  done
+done
+
+awk -F, '
+    NR == 1 { for (i = 1; i <= NF; i++) key[i] = $i; next }
+    {
+        printf "%s  {", (NR == 2 ? "[\n" : ",\n")
+        for (i = 1; i <= NF; i++) {
+            if (i == 1) printf "\"%s\": \"%s\"", key[i], $i
+            else printf ", \"%s\": %s", key[i], $i
+        }
+        printf "}"
+    }
+    END { print (NR > 1 ? "\n]" : "[]") }' "$CSV" >"$JSON"
+
+column -s, -t "$CSV" 2>/dev/null || cat "$CSV"
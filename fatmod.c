@@ -1,628 +1,722 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <string.h>
-#include <fcntl.h>
-#include <assert.h>
-#include <ctype.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <time.h>
-#include <errno.h>
-#include <linux/msdos_fs.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "fatmod.h"
+
+#define SCRIPT_LINE_MAX 4096         // longest command line in a -b script
+#define SCRIPT_ARGS_MAX 16           // most words in one script command
+#define SERVE_THREADS 16             // --serve workers, each on one connection at a time
+#define SERVE_BACKLOG 64             // accepted connections waiting for a worker
+#define SERVE_MESSAGE_MAX (16 * 1024 * 1024)  // largest --serve request or reply body
+
+// Fixed head of a --serve request body, followed by IMAGE\0 PATH\0 [data]
+struct serve_request {
+    uint8_t op;
+    uint8_t pad[3];
+    uint32_t count;
+    uint64_t offset;
+};
+
+// A growing reply body
+struct serve_buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct served_image {
+    const char *path;
+    struct fat_volume *vol;
+};
+
+struct server {
+    struct served_image *images;
+    int nimages;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;              // a connection was queued, or stopping
+    pthread_cond_t room;               // the queue has space again
+    int queue[SERVE_BACKLOG];
+    int head;
+    int queued;
+    int active[SERVE_THREADS];         // connection each worker is serving, or -1
+    int stopping;
+};
+
+struct serve_worker_arg {
+    struct server *srv;
+    int id;
+};
 
-#define FALSE 0
-#define TRUE 1
-
-#define SECTORSIZE 512   // bytes
-#define CLUSTERSIZE  1024  // bytes
-#define SECTORS_PER_CLUSTER (CLUSTERSIZE / SECTORSIZE)
-
-
-#define FAT_EOC 0x0FFFFFF8
-#define FAT_START_SECTOR 32  // Define the start sector of the FAT table
-
-// Global Variables
-unsigned char sector[SECTORSIZE];
-unsigned char cluster[CLUSTERSIZE];
-struct msdos_dir_entry *dep;
-uint16_t reserved_sector_count;
-uint8_t num_fats;
-uint32_t sectors_per_fat;
-uint32_t root_cluster_start_sector;
-
-// Function declarations
-int readsector(int fd, unsigned char *buf, unsigned int snum);
-int writesector(int fd, unsigned char *buf, unsigned int snum);
-//int readcluster(int fd, unsigned char *buf, unsigned int cnum);
-//int writecluster(int fd, unsigned char *buf, unsigned int cnum);
-void list_root_directory(int fd);
-void display_file_ascii(int fd, const char *filename);
-void display_file_binary(int fd, const char *filename);
-void create_file(int fd, const char *filename);
-void delete_file(int fd, const char *filename);
-void write_to_file(int fd, const char *filename, int offset, int n, int data);
-uint32_t get_next_cluster(int fd, uint32_t cluster, uint16_t reserved_sector_count);
-uint32_t get_file_size(int fd, uint32_t start_cluster);
 void print_help();
-uint32_t allocate_new_cluster(int fd);
-void set_next_cluster(int fd, uint32_t cluster, uint32_t next_cluster, uint16_t reserved_sector_count);
-struct msdos_dir_entry* find_file_entry(int fd, const char *filename);
-void read_boot_sector(int fd);
-void to_uppercase(char *str);
+int run_command(struct fat_volume *vol, int argc, char *argv[]);
+int changes_image(int argc, char *argv[]);
+int run_script(struct fat_volume *vol, const char *scriptname);
+int serve(const char *sockpath, int flags, int show_stats, int nimages, char *images[]);
+void *serve_worker(void *arg);
+void serve_connection(struct server *srv, int conn);
+int serve_request(struct server *srv, const unsigned char *body, uint32_t len, struct serve_buffer *out);
+int serve_list_entry(const char *name, uint32_t size, int is_dir, void *arg);
+int buffer_reserve(struct serve_buffer *buf, size_t len);
+int recv_full(int fd, void *buf, size_t len);
+int send_reply(int fd, int32_t status, const struct serve_buffer *out);
 
 
 int main(int argc, char *argv[])
 {
-    char diskname[128];
-    int fd;
+    int flags = 0;
+    int show_stats = 0;
+    const char *serve_path = NULL;
+    const char *overlay_path = NULL;
+
+    // Strip global --options so the positional layout below stays the same
+    int nargs = 0;
+    for (int i = 0; i < argc; i++) {
+        if (i > 0 && strcmp(argv[i], "--sync-each") == 0) {
+            flags |= FAT_OPEN_SYNC_EACH;
+        } else if (i > 0 && strcmp(argv[i], "--mmap") == 0) {
+            flags |= FAT_OPEN_MMAP;
+        } else if (i > 0 && strcmp(argv[i], "--punch-holes") == 0) {
+            flags |= FAT_OPEN_PUNCH_HOLES;
+        } else if (i > 0 && strcmp(argv[i], "--track-changes") == 0) {
+            flags |= FAT_OPEN_TRACK_CHANGES;
+        } else if (i > 0 && strcmp(argv[i], "--overlay") == 0 && i + 1 < argc) {
+            overlay_path = argv[++i];
+        } else if (i > 0 && strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (i > 0 && strcmp(argv[i], "--stats") == 0) {
+            show_stats = 1;
+        } else if (i > 0 && strcmp(argv[i], "--stats=json") == 0) {
+            show_stats = 2;
+        } else if (i > 0 && strncmp(argv[i], "--io-engine=", 12) == 0) {
+            const char *engine = argv[i] + 12;
+            flags &= ~(FAT_OPEN_IO_THREADS | FAT_OPEN_IO_SYNC);
+            if (strcmp(engine, "threads") == 0) {
+                flags |= FAT_OPEN_IO_THREADS;
+            } else if (strcmp(engine, "sync") == 0) {
+                flags |= FAT_OPEN_IO_SYNC;
+            } else if (strcmp(engine, "uring") != 0) {
+                print_help();
+                return 1;
+            }
+        } else {
+            argv[nargs++] = argv[i];
+        }
+    }
+    argc = nargs;
+    if (show_stats) {
+        flags |= FAT_OPEN_STATS;
+    }
+
+    if (serve_path != NULL) {
+        if (argc < 2 || overlay_path != NULL) {
+            print_help();
+            return 1;
+        }
+        return serve(serve_path, flags, show_stats, argc - 1, argv + 1);
+    }
 
     if (argc < 3) {
         print_help();
         return 1;
     }
 
-    strcpy(diskname, argv[1]);
+    // Deltas are written straight to the image, which must not be loaded
+    if (strcmp(argv[2], "-apply-delta") == 0) {
+        if (argc < 4 || overlay_path != NULL) {
+            print_help();
+            return 1;
+        }
+        return fat_apply_delta(argv[1], argv[3]);
+    }
 
-    fd = open(diskname, O_SYNC | O_RDWR);
-    if (fd < 0) {
-        printf("could not open disk image\n");
+    struct fat_volume *vol = fat_open_overlay(argv[1], overlay_path, flags);
+    if (vol == NULL) {
         exit(1);
     }
 
-    read_boot_sector(fd);
+    int result;
+    if (strcmp(argv[2], "-b") == 0) {
+        if (argc < 4) {
+            print_help();
+            fat_close(vol);
+            return 1;
+        }
+        result = run_script(vol, argv[3]);
+    } else {
+        result = run_command(vol, argc - 2, argv + 2);
+    }
+
+    if (fat_flush(vol) != 0) {
+        result = 1;
+    }
+    if (show_stats) {
+        fat_print_stats(vol, stderr, show_stats == 2);
+    }
+    fat_close(vol);
+    return result;
+}
 
-    if (strcmp(argv[2], "-l") == 0) {
-        list_root_directory(fd);
-    } else if (strcmp(argv[2], "-r") == 0) {
+// Whether the command in argv writes to the image
+int changes_image(int argc, char *argv[]) {
+    static const char *const writers[] = { "-c", "-d", "-w", "-i", "-I", "-commit", "-defrag" };
+    for (size_t i = 0; i < sizeof(writers) / sizeof(writers[0]); i++) {
+        if (strcmp(argv[0], writers[i]) == 0) return 1;
+    }
+    return strcmp(argv[0], "-check") == 0 && argc > 1 && strcmp(argv[1], "--repair") == 0;
+}
+
+// Run one command; argv[0] is the option, e.g. "-w", followed by its arguments
+int run_command(struct fat_volume *vol, int argc, char *argv[]) {
+    // Refuse up front rather than report success and fail at the flush
+    if (fat_read_only(vol) && changes_image(argc, argv)) {
+        fprintf(stderr, "%s: %s: the image is packed; open it with --overlay to change it\n",
+                argv[0], strerror(EROFS));
+        return 1;
+    }
+    if (strcmp(argv[0], "-l") == 0) {
+        return fat_list(vol, argc > 1 ? argv[1] : NULL);
+    } else if (strcmp(argv[0], "-r") == 0) {
+        // -r [-a|-b|-raw] [-o OFFSET] [-n LEN] FILENAME
+        const char *mode = "-a";
+        const char *filename = NULL;
+        uint32_t offset = 0, len = UINT32_MAX;
+        for (int i = 1; i < argc; i++) {
+            if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-n") == 0) && i + 1 < argc) {
+                unsigned long value = strtoul(argv[i + 1], NULL, 0);
+                if (value > UINT32_MAX) value = UINT32_MAX;
+                if (argv[i][1] == 'o') offset = value;
+                else len = value;
+                i++;
+            } else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "-b") == 0 ||
+                       strcmp(argv[i], "-raw") == 0) {
+                mode = argv[i];
+            } else if (filename == NULL && argv[i][0] != '-') {
+                filename = argv[i];
+            } else {
+                filename = NULL;
+                break;
+            }
+        }
+        if (filename == NULL) {
+            print_help();
+            return 1;
+        }
+        int format = FAT_DUMP_ASCII;
+        if (strcmp(mode, "-b") == 0) {
+            format = FAT_DUMP_HEX;
+        } else if (strcmp(mode, "-raw") == 0) {
+            format = FAT_DUMP_RAW;
+        }
+        return fat_dump(vol, filename, format, offset, len);
+    } else if (strcmp(argv[0], "-c") == 0) {
+        if (argc < 2) {
+            print_help();
+            return 1;
+        }
+        return fat_create(vol, argv[1]);
+    } else if (strcmp(argv[0], "-d") == 0) {
+        if (argc < 2) {
+            print_help();
+            return 1;
+        }
+        return fat_unlink(vol, argv[1]);
+    } else if (strcmp(argv[0], "-w") == 0) {
         if (argc < 5) {
             print_help();
-            close(fd);
             return 1;
         }
-        if (strcmp(argv[3], "-a") == 0) {
-            display_file_ascii(fd, argv[4]);
-        } else if (strcmp(argv[3], "-b") == 0) {
-            display_file_binary(fd, argv[4]);
-        } else {
+        int offset = atoi(argv[2]);
+        int n = atoi(argv[3]);
+        int data = atoi(argv[4]);
+        return fat_fill(vol, argv[1], offset, n, data);
+    } else if (strcmp(argv[0], "-i") == 0) {
+        if (argc < 2) {
             print_help();
+            return 1;
         }
-    } else if (strcmp(argv[2], "-c") == 0) {
-        if (argc < 4) {
+        return fat_import(vol, argv[1], argc > 2 ? argv[2] : NULL);
+    } else if (strcmp(argv[0], "-I") == 0) {
+        if (argc < 2) {
             print_help();
-            close(fd);
             return 1;
         }
-        create_file(fd, argv[3]);
-    } else if (strcmp(argv[2], "-d") == 0) {
-        if (argc < 4) {
+        return fat_import_list(vol, argv[1]);
+    } else if (strcmp(argv[0], "-commit") == 0) {
+        return fat_commit(vol);
+    } else if (strcmp(argv[0], "-pack") == 0) {
+        if (argc < 2) {
             print_help();
-            close(fd);
             return 1;
         }
-        delete_file(fd, argv[3]);
-    } else if (strcmp(argv[2], "-w") == 0) {
-        if (argc < 7) {
+        return fat_pack(vol, argv[1]);
+    } else if (strcmp(argv[0], "-export-delta") == 0) {
+        if (argc < 3) {
             print_help();
-            close(fd);
             return 1;
         }
-        int offset = atoi(argv[4]);
-        int n = atoi(argv[5]);
-        int data = atoi(argv[6]);
-        write_to_file(fd, argv[3], offset, n, data);
-    } else if (strcmp(argv[2], "-h") == 0) {
+        return fat_export_delta(vol, strtoul(argv[1], NULL, 10), argv[2]);
+    } else if (strcmp(argv[0], "-apply-delta") == 0) {
+        printf("-apply-delta cannot run while the image is open\n");
+        return 1;
+    } else if (strcmp(argv[0], "-defrag") == 0) {
+        return fat_defragment(vol);
+    } else if (strcmp(argv[0], "-check") == 0) {
+        return fat_check(vol, argc > 1 && strcmp(argv[1], "--repair") == 0);
+    } else if (strcmp(argv[0], "-x") == 0) {
+        if (argc < 2) {
+            print_help();
+            return 1;
+        }
+        return fat_extract(vol, argv[1], argc - 2, argv + 2);
+    } else if (strcmp(argv[0], "-h") == 0) {
         print_help();
     } else {
         print_help();
     }
-
-    close(fd);
     return 0;
 }
 
-int readsector(int fd, unsigned char *buf, unsigned int snum) {
-    off_t offset;
-    int n;
-    offset = snum * SECTORSIZE;
-    lseek(fd, offset, SEEK_SET);
-    n = read(fd, buf, SECTORSIZE);
-    return (n == SECTORSIZE) ? 0 : 1;
-}
-
-int writesector(int fd, unsigned char *buf, unsigned int snum) {
-    off_t offset;
-    int n;
-    offset = snum * SECTORSIZE;
-    lseek(fd, offset, SEEK_SET);
-    n = write(fd, buf, SECTORSIZE);
-    fsync(fd);
-    return (n == SECTORSIZE) ? 0 : 1;
-}
-
-/* int readcluster(int fd, unsigned char *buf, unsigned int cnum) {
-    unsigned int snum = cnum * SECTORS_PER_CLUSTER;  // Calculate the starting sector number
-    for (int i = 0; i < SECTORS_PER_CLUSTER; i++) {
-        if (readsector(fd, buf + (i * SECTORSIZE), snum + i) != 0) {
-            return 1;  // If any sector read fails, return error
-        }
+// Run every command of a script ("-" for stdin) against the open image.
+// Lines hold one command each, written as on the command line without the
+// image name; blank lines and lines starting with '#' are skipped. All
+// changes are committed together by the caller's final flush.
+int run_script(struct fat_volume *vol, const char *scriptname) {
+    FILE *script = strcmp(scriptname, "-") == 0 ? stdin : fopen(scriptname, "r");
+    if (script == NULL) {
+        printf("could not open script: %s\n", scriptname);
+        return 1;
     }
-    return 0;  // Successfully read the entire cluster
-}
 
-int writecluster(int fd, unsigned char *buf, unsigned int cnum) {
-    unsigned int snum = cnum * SECTORS_PER_CLUSTER;  // Calculate the starting sector number
-    for (int i = 0; i < SECTORS_PER_CLUSTER; i++) {
-        if (writesector(fd, buf + (i * SECTORSIZE), snum + i) != 0) {
-            return 1;  // If any sector write fails, return error
+    char line[SCRIPT_LINE_MAX];
+    char *args[SCRIPT_ARGS_MAX];
+    int result = 0;
+    int line_number = 0;
+    while (fgets(line, sizeof(line), script) != NULL) {
+        line_number++;
+        int nargs = 0;
+        char *save = NULL;
+        for (char *word = strtok_r(line, " \t\r\n", &save);
+             word != NULL && nargs < SCRIPT_ARGS_MAX;
+             word = strtok_r(NULL, " \t\r\n", &save)) {
+            args[nargs++] = word;
         }
-    }
-    return 0;  // Successfully wrote the entire cluster
-} */
-
-void list_root_directory(int fd) {
-    dep = (struct msdos_dir_entry *)cluster;
-
-    // Read the root directory cluster
-    if (readsector(fd, cluster, root_cluster_start_sector) != 0) {
-        perror("Failed to read root directory cluster");
-        return;
-    }
-
-    // Iterate through directory entries
-    for (int i = 0; i < CLUSTERSIZE / sizeof(struct msdos_dir_entry); ++i) {
-        if (dep->name[0] == 0x00) break;
-        if (dep->name[0] == 0xE5) {
-            dep++;
+        if (nargs == 0 || args[0][0] == '#') {
             continue;
         }
-        char name[9];
-        char ext[4];
-        strncpy(name, (char *)dep->name, 8);
-        name[8] = '\0';
-        strncpy(ext, (char *)dep->name + 8, 3);
-        ext[3] = '\0';
-
-        printf("%s.%s %d\n", name, ext, dep->size);
-        dep++;
-    }
-}
-
-void display_file_ascii(int fd, const char *filename) {
-
-    // Locate the file in the root directory
-    struct msdos_dir_entry *file_entry = find_file_entry(fd, filename);
-    if (file_entry == NULL) {
-        printf("File not found: %s\n", filename);
-        return;
-    }
-
-    //uint32_t cluster_num = le16toh(file_entry->start) | (le16toh(file_entry->starthi) << 16);
-    //uint32_t file_size = le32toh(file_entry->size);
-    //uint32_t read_size = 0;
-
-    // Read and display the file content
-    uint32_t cluster_num = file_entry->start;
-    uint32_t file_size = file_entry->size;
-    unsigned char file_buffer[CLUSTERSIZE];
-    uint32_t read_size = 0;
-
-    while (cluster_num < FAT_EOC) {
-        unsigned int cluster_start_sector = root_cluster_start_sector + (cluster_num - 2) * SECTORS_PER_CLUSTER;
-        if (readsector(fd, file_buffer, cluster_start_sector) != 0) {
-            perror("Failed to read file cluster");
-            return;
+        if (strcmp(args[0], "-b") == 0) {
+            fprintf(stderr, "%s:%d: scripts cannot be nested\n", scriptname, line_number);
+            result = 1;
+            continue;
         }
-        for (int i = 0; i < CLUSTERSIZE && read_size < file_size; i++, read_size++) {
-            printf("%c", file_buffer[i]);
+        if (run_command(vol, nargs, args) != 0) {
+            fprintf(stderr, "%s:%d: command failed\n", scriptname, line_number);
+            result = 1;
         }
-        cluster_num = get_next_cluster(fd, cluster_num, reserved_sector_count);
     }
-    printf("\n");
-}
 
-void display_file_binary(int fd, const char *filename) {
-
-    // Locate the file in the root directory
-    struct msdos_dir_entry *file_entry = find_file_entry(fd,filename);
-    if (file_entry == NULL) {
-        printf("File not found: %s\n", filename);
-        return;
-    }
-
-    // Read and display the file content in binary (hexadecimal) form
-    //uint32_t cluster_num = le16toh(file_entry->start) | (le16toh(file_entry->starthi) << 16);
-    //uint32_t file_size = le32toh(file_entry->size);
-    uint32_t cluster_num = file_entry->start;
-    uint32_t file_size = file_entry->size;
-    unsigned char file_buffer[CLUSTERSIZE];
-    uint32_t read_size = 0;
-    uint32_t offset = 0;
-
-    while (cluster_num < FAT_EOC && read_size < file_size) {
-        unsigned int cluster_start_sector = root_cluster_start_sector + (cluster_num - 2) * SECTORS_PER_CLUSTER;
-        for (int i = 0; i < SECTORS_PER_CLUSTER && read_size < file_size; i++) {
-            if (readsector(fd, file_buffer, cluster_start_sector + i) != 0) {
-                perror("Failed to read file cluster");
-                return;
-            }
-            for (int j = 0; j < SECTORSIZE && read_size < file_size; j++, read_size++, offset++) {
-                if (offset % 16 == 0) {
-                    printf("\n%08x: ", offset);
-                }
-                printf("%02x ", file_buffer[j]);
-            }
-        }
-        cluster_num = get_next_cluster(fd, cluster_num, reserved_sector_count);
+    if (script != stdin) {
+        fclose(script);
     }
-    printf("\n");
+    return result;
 }
 
-void create_file(int fd, const char *filename) {
-    dep = (struct msdos_dir_entry *)cluster;
-    
-    if (readsector(fd, cluster, root_cluster_start_sector) != 0) {
-        perror("Failed to read root directory cluster");
-        return;
-    }
+// --serve: a daemon that keeps images open, with their FAT, directory
+// indexes and caches resident, and answers requests on a Unix domain
+// socket. Every message is a native-endian uint32_t length of the bytes
+// that follow:
+//
+//   request:  struct serve_request, IMAGE\0 PATH\0 [data]
+//   reply:    int32_t status (0 or an errno value), [data]
+//
+// IMAGE is one of the image paths the daemon was started with. The ops:
+//   'l'  list directory PATH ("" for the root) as "NAME SIZE\n" lines,
+//        with a '/' after the names of directories
+//   'r'  reply with up to 'count' bytes of PATH from 'offset'
+//   'c'  create PATH, empty; EEXIST if it exists
+//   'd'  delete PATH
+//   'w'  write the data to PATH at 'offset'
+// A connection may carry any number of requests. Connections are served
+// by a pool of workers; reads of one image run in parallel, while changes
+// to it run one at a time and are committed before they are answered.
+// SIGINT or SIGTERM stops the daemon after the requests in progress.
+static volatile sig_atomic_t serve_stop;
+
+static void serve_signal(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
 
-    struct msdos_dir_entry *file_entry = find_file_entry(fd, filename);
-    if (file_entry != NULL) {
-        printf("File already exists: %s\n", filename);
-        return;
+int serve(const char *sockpath, int flags, int show_stats, int nimages, char *images[]) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", sockpath);
+        return 1;
     }
-
-    dep = (struct msdos_dir_entry *)cluster;
-    struct msdos_dir_entry *free_entry = NULL;
-    for (int i = 0; i < CLUSTERSIZE / sizeof(struct msdos_dir_entry); ++i) {
-        if (dep->name[0] == 0x00 || dep->name[0] == 0xE5) {
-            free_entry = dep;
-            break;
-        }
-        dep++;
+    strcpy(addr.sun_path, sockpath);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        perror("socket");
+        return 1;
     }
-
-    if (free_entry == NULL) {
-        printf("No free directory entry found.\n");
-        return;
+    int bound = bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+    if (bound != 0 && errno == EADDRINUSE) {
+        // Take over the path only if nobody answers on it any more
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) close(probe);
+        if (live) {
+            fprintf(stderr, "Another daemon is serving %s\n", sockpath);
+            close(listener);
+            return 1;
+        }
+        unlink(sockpath);
+        bound = bind(listener, (struct sockaddr *)&addr, sizeof(addr));
     }
-
-    // Parse the filename into name and extension
-    char name[9] = {0};  // 8 characters for name + null terminator
-    char ext[4] = {0};   // 3 characters for extension + null terminator
-    char *dot = strrchr(filename, '.');
-
-    if (dot == NULL) {
-        strncpy(name, filename, 8);  // No extension found, use entire filename
-    } else {
-        strncpy(name, filename, dot - filename);  // Copy name part
-        strncpy(ext, dot + 1, 3);  // Copy extension part
+    if (bound != 0 || listen(listener, SERVE_BACKLOG) != 0) {
+        perror(sockpath);
+        close(listener);
+        return 1;
     }
 
-    // Pad name and extension with spaces
-    for (int i = strlen(name); i < 8; i++) {
-        name[i] = ' ';
+    struct server srv = { .nimages = nimages };
+    srv.images = calloc(nimages, sizeof(struct served_image));
+    for (int i = 0; i < nimages && srv.images != NULL; i++) {
+        srv.images[i].path = images[i];
+        srv.images[i].vol = fat_open(images[i], flags);
+        if (srv.images[i].vol == NULL) {
+            fprintf(stderr, "%s: cannot serve this image\n", images[i]);
+            while (--i >= 0) fat_close(srv.images[i].vol);
+            free(srv.images);
+            srv.images = NULL;
+        }
     }
-    for (int i = strlen(ext); i < 3; i++) {
-        ext[i] = ' ';
+    if (srv.images == NULL) {
+        close(listener);
+        unlink(sockpath);
+        return 1;
     }
 
-    // Create the new file entry
-    memset(free_entry, 0, sizeof(struct msdos_dir_entry));
-    memcpy(free_entry->name, name, 8);
-    memcpy(free_entry->name + 8, ext, 3);
-    free_entry->attr = ATTR_ARCH; // Archive attribute
-    free_entry->start = 0; // No cluster allocated initially
-    free_entry->size = 0; // Initial size 0
-
-    // Write the updated root directory back to disk
-    if (writesector(fd, cluster, root_cluster_start_sector) != 0) {
-        perror("Failed to write root directory cluster");
-        return;
+    // Only this thread takes the signals, so they interrupt accept()
+    struct sigaction sa = { .sa_handler = serve_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.ready, NULL);
+    pthread_cond_init(&srv.room, NULL);
+    pthread_t threads[SERVE_THREADS];
+    struct serve_worker_arg args[SERVE_THREADS];
+    int started = 0;
+    for (int t = 0; t < SERVE_THREADS; t++) {
+        srv.active[t] = -1;
+        args[t].srv = &srv;
+        args[t].id = t;
+        if (pthread_create(&threads[t], NULL, serve_worker, &args[t]) != 0) break;
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    fprintf(stderr, "Serving %d image%s on %s with %d workers\n",
+            nimages, nimages == 1 ? "" : "s", sockpath, started);
+
+    int result = started == 0;
+    while (!serve_stop && started > 0) {
+        int conn = accept(listener, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            result = 1;
+            break;
+        }
+        pthread_mutex_lock(&srv.lock);
+        while (srv.queued == SERVE_BACKLOG && !serve_stop) {
+            pthread_cond_wait(&srv.room, &srv.lock);
+        }
+        srv.queue[(srv.head + srv.queued++) % SERVE_BACKLOG] = conn;
+        pthread_cond_signal(&srv.ready);
+        pthread_mutex_unlock(&srv.lock);
+    }
+
+    // Cut off the connections in progress; their current requests finish first
+    pthread_mutex_lock(&srv.lock);
+    srv.stopping = 1;
+    for (int t = 0; t < started; t++) {
+        if (srv.active[t] >= 0) shutdown(srv.active[t], SHUT_RD);
+    }
+    pthread_cond_broadcast(&srv.ready);
+    pthread_mutex_unlock(&srv.lock);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    while (srv.queued > 0) {
+        close(srv.queue[srv.head]);
+        srv.head = (srv.head + 1) % SERVE_BACKLOG;
+        srv.queued--;
+    }
+    close(listener);
+    unlink(sockpath);
+
+    for (int i = 0; i < nimages; i++) {
+        if (show_stats) {
+            fprintf(stderr, "%s:\n", srv.images[i].path);
+            fat_print_stats(srv.images[i].vol, stderr, show_stats == 2);
+        }
+        if (fat_close(srv.images[i].vol) != 0) {
+            result = 1;
+        }
     }
-
-    printf("File created: %s\n", filename);
+    free(srv.images);
+    pthread_mutex_destroy(&srv.lock);
+    pthread_cond_destroy(&srv.ready);
+    pthread_cond_destroy(&srv.room);
+    return result;
 }
 
-void delete_file(int fd, const char *filename) {
-
-    // Locate the file in the root directory
-    struct msdos_dir_entry *file_entry = find_file_entry(fd, filename);
-    if (file_entry == NULL) {
-        printf("File not found: %s\n", filename);
-        return;
-    }
-
-    // Deallocate all clusters used by the file
-    uint32_t cluster_num = le16toh(file_entry->start) | (le16toh(file_entry->starthi) << 16);
-    unsigned char fat_sector[SECTORSIZE];
-
-    while (cluster_num < FAT_EOC && cluster_num != 0) {
-        uint32_t fat_offset = cluster_num * 4;
-        uint32_t sector_number = reserved_sector_count + (fat_offset / SECTORSIZE);
-        uint32_t entry_offset = fat_offset % SECTORSIZE;
-
-        if (readsector(fd, fat_sector, sector_number) != 0) {
-            perror("Failed to read FAT sector");
-            return;
+// Take queued connections one at a time and answer them until they close
+void *serve_worker(void *arg) {
+    struct serve_worker_arg *worker = arg;
+    struct server *srv = worker->srv;
+    for (;;) {
+        pthread_mutex_lock(&srv->lock);
+        while (srv->queued == 0 && !srv->stopping) {
+            pthread_cond_wait(&srv->ready, &srv->lock);
         }
-
-        uint32_t next_cluster = *(uint32_t *)(fat_sector + entry_offset) & 0x0FFFFFFF;
-        *(uint32_t *)(fat_sector + entry_offset) = 0;  // Mark cluster as free
-
-        if (writesector(fd, fat_sector, sector_number) != 0) {
-            perror("Failed to write FAT sector");
-            return;
+        if (srv->stopping) {
+            pthread_mutex_unlock(&srv->lock);
+            return NULL;
         }
+        int conn = srv->queue[srv->head];
+        srv->head = (srv->head + 1) % SERVE_BACKLOG;
+        srv->queued--;
+        srv->active[worker->id] = conn;
+        pthread_cond_signal(&srv->room);
+        pthread_mutex_unlock(&srv->lock);
 
-        cluster_num = next_cluster;
-    }
-
-    // Mark the directory entry as deleted
-    file_entry->name[0] = 0xE5;
+        serve_connection(srv, conn);
 
-    // Write the updated root directory back to disk
-    if (writesector(fd, cluster, root_cluster_start_sector) != 0) {
-        perror("Failed to write root directory cluster");
-        return;
+        pthread_mutex_lock(&srv->lock);
+        srv->active[worker->id] = -1;
+        pthread_mutex_unlock(&srv->lock);
+        close(conn);
     }
-
-    printf("File deleted: %s\n", filename);
 }
 
-void write_to_file(int fd, const char *filename, int offset, int n, int data) {
-    struct msdos_dir_entry *file_entry = find_file_entry(fd, filename);
-    if (file_entry == NULL) {
-        printf("File not found: %s\n", filename);
-        return;
-    }
-
-    // Get the start cluster and file size
-    uint32_t start_cluster = le16toh(file_entry->start) | (le16toh(file_entry->starthi) << 16);
-    uint32_t file_size = file_entry->size;
-    // Check if the offset exceeds the file size
-    if (offset > file_size) {
-        printf("Offset exceeds file size. File size: %u bytes\n", file_size);
-        return;
-    }
-
-    // Calculate the starting cluster and intra-cluster offset
-    uint32_t cluster_num = start_cluster;
-    uint32_t cluster_offset = offset / CLUSTERSIZE;
-    uint32_t intra_cluster_offset = offset % CLUSTERSIZE;
-
-    // Traverse to the correct starting cluster
-    while (cluster_offset > 0) {
-        uint32_t next_cluster = get_next_cluster(fd, cluster_num, reserved_sector_count);
-        if (next_cluster >= FAT_EOC) {
-            next_cluster = allocate_new_cluster(fd);
-            set_next_cluster(fd, cluster_num, next_cluster, reserved_sector_count);
-        }
-        cluster_num = next_cluster;
-        cluster_offset--;
-    }
-
-    // Start writing data byte by byte
-    uint32_t written = 0;
-    unsigned char sector_buffer[SECTORSIZE];
-    unsigned int sector_num = (cluster_num - 2) * SECTORS_PER_CLUSTER + root_cluster_start_sector;
-
-    while (written < n) {
-        // Calculate sector and intra-sector offset
-        uint32_t sector_offset = intra_cluster_offset / SECTORSIZE;
-        uint32_t intra_sector_offset = intra_cluster_offset % SECTORSIZE;
-
-        // Read the current sector
-        if (readsector(fd, sector_buffer, sector_num + sector_offset) != 0) {
-            perror("Failed to read file sector");
-            return;
-        }
-
-        // Write data to the buffer
-        while (intra_sector_offset < SECTORSIZE && written < n) {
-            sector_buffer[intra_sector_offset++] = (unsigned char)data;
-            written++;
-        }
-
-        // Write the modified sector back to the disk
-        if (writesector(fd, sector_buffer, sector_num + sector_offset) != 0) {
-            perror("Failed to write file sector");
-            return;
-        }
-
-        // Move to the next sector if necessary
-        if (intra_sector_offset == SECTORSIZE) {
-            intra_cluster_offset += SECTORSIZE;
-            intra_sector_offset = 0;
-
-            // Move to the next cluster if necessary
-            if (intra_cluster_offset >= CLUSTERSIZE) {
-                uint32_t next_cluster = get_next_cluster(fd, cluster_num, reserved_sector_count);
-                if (next_cluster >= FAT_EOC) {
-                    next_cluster = allocate_new_cluster(fd);
-                    set_next_cluster(fd, cluster_num, next_cluster, reserved_sector_count);
-                }
-                cluster_num = next_cluster;
-                intra_cluster_offset = 0;
-                sector_num = (cluster_num - 2) * SECTORS_PER_CLUSTER + root_cluster_start_sector;
-            }
+void serve_connection(struct server *srv, int conn) {
+    unsigned char *body = NULL;
+    size_t body_cap = 0;
+    struct serve_buffer out = { NULL, 0, 0 };
+    uint32_t len;
+    while (recv_full(conn, &len, sizeof(len)) == 0) {
+        if (len > SERVE_MESSAGE_MAX) {
+            // The stream cannot be resynchronised after an oversized message
+            out.len = 0;
+            send_reply(conn, EMSGSIZE, &out);
+            break;
         }
-    }
-
-    // Update the file size if we wrote past the original end
-    if (offset + n > file_size) {
-        file_entry->size = offset + n;
-        if (writesector(fd, sector, root_cluster_start_sector) != 0) {
-            perror("Failed to update directory entry");
-            return;
+        if (len > body_cap) {
+            unsigned char *grown = realloc(body, len);
+            if (grown == NULL) break;
+            body = grown;
+            body_cap = len;
         }
+        if (recv_full(conn, body, len) != 0) break;
+        out.len = 0;
+        int status = serve_request(srv, body, len, &out);
+        if (status != 0) {
+            out.len = 0;
+        }
+        if (send_reply(conn, status, &out) != 0) break;
     }
-
-    printf("Successfully wrote %d bytes to %s\n", n, filename);
+    free(body);
+    free(out.data);
 }
 
-
-
-// Define the helper functions
-
-uint32_t allocate_new_cluster(int fd) {
-    unsigned char sector[SECTORSIZE];
-    unsigned char sectorBoot[SECTORSIZE];
-    readsector(fd, sectorBoot, 0);
-    uint16_t reserved_sector_count = *(uint16_t *)(sectorBoot + 14);
-    uint32_t sectors_per_fat = *(uint32_t *)(sectorBoot + 36);
-
-    for (uint32_t cluster = 2; cluster < sectors_per_fat * SECTORSIZE / 4; cluster++) {
-        uint32_t fat_offset = cluster * 4;
-        uint32_t sector_number = reserved_sector_count + (fat_offset / SECTORSIZE);
-        uint32_t entry_offset = fat_offset % SECTORSIZE;
-
-        if (readsector(fd, sector, sector_number) != 0) {
-            perror("Failed to read FAT sector");
-            exit(1);
-        }
-
-        uint32_t value = *(uint32_t *)(sector + entry_offset) & 0x0FFFFFFF;
-        if (value == 0) {
-            *(uint32_t *)(sector + entry_offset) = FAT_EOC;
-            if (writesector(fd, sector, sector_number) != 0) {
-                perror("Failed to write FAT sector");
-                exit(1);
-            }
-            return cluster;
+// Carry out one request, leaving any reply data in 'out'. Returns 0 or an
+// errno value for the client.
+int serve_request(struct server *srv, const unsigned char *body, uint32_t len, struct serve_buffer *out) {
+    struct serve_request req;
+    if (len < sizeof(req)) return EINVAL;
+    memcpy(&req, body, sizeof(req));
+    const char *end = (const char *)body + len;
+    const char *image = (const char *)body + sizeof(req);
+    const char *path = memchr(image, '\0', end - image);
+    if (path++ == NULL) return EINVAL;
+    const char *data = memchr(path, '\0', end - path);
+    if (data++ == NULL) return EINVAL;
+
+    struct fat_volume *vol = NULL;
+    for (int i = 0; i < srv->nimages && vol == NULL; i++) {
+        if (strcmp(srv->images[i].path, image) == 0) vol = srv->images[i].vol;
+    }
+    if (vol == NULL) return ENOENT;
+
+    struct fat_file *file;
+    ssize_t n;
+    int err;
+    switch (req.op) {
+    case 'l':
+        n = fat_readdir(vol, path[0] ? path : NULL, serve_list_entry, out);
+        return n < 0 ? errno : n;
+    case 'r':
+        if (req.count > SERVE_MESSAGE_MAX) return EMSGSIZE;
+        if (buffer_reserve(out, req.count) != 0) return ENOMEM;
+        if ((file = fat_file_open(vol, path, 0)) == NULL) return errno;
+        n = fat_file_pread(file, out->data, req.count, req.offset);
+        err = errno;
+        fat_file_close(file);
+        if (n < 0) return err;
+        out->len = n;
+        return 0;
+    case 'c':
+        if ((file = fat_file_open(vol, path, FAT_FILE_CREATE | FAT_FILE_EXCL)) == NULL) return errno;
+        fat_file_close(file);
+        break;
+    case 'd':
+        if (fat_remove(vol, path) != 0) return errno;
+        break;
+    case 'w':
+        if ((file = fat_file_open(vol, path, 0)) == NULL) return errno;
+        if (req.offset > INT64_MAX) {
+            n = -1;
+            err = EFBIG;
+        } else {
+            fat_file_seek(file, req.offset, SEEK_SET);
+            n = fat_file_write(file, data, end - data);
+            err = errno;
         }
+        fat_file_close(file);
+        if (n < 0) return err;
+        break;
+    default:
+        return EINVAL;
     }
 
-    perror("No free cluster found");
-    exit(1);
+    // Changes are committed before the client hears about them
+    return fat_flush(vol) == 0 ? 0 : EIO;
 }
 
-void set_next_cluster(int fd, uint32_t cluster, uint32_t next_cluster, uint16_t reserved_sector_count) {
-    unsigned char sector[SECTORSIZE];
-
-    uint32_t fat_offset = cluster * 4;
-    uint32_t sector_number = reserved_sector_count + (fat_offset / SECTORSIZE);
-    uint32_t entry_offset = fat_offset % SECTORSIZE;
-
-    if (readsector(fd, sector, sector_number) != 0) {
-        perror("Failed to read FAT sector");
-        exit(1);
-    }
-
-    *(uint32_t *)(sector + entry_offset) = next_cluster;
-
-    if (writesector(fd, sector, sector_number) != 0) {
-        perror("Failed to write FAT sector");
-        exit(1);
-    }
+int serve_list_entry(const char *name, uint32_t size, int is_dir, void *arg) {
+    struct serve_buffer *out = arg;
+    char line[64];
+    int n = snprintf(line, sizeof(line), "%s%s %u\n", name, is_dir ? "/" : "", size);
+    if (out->len + n > SERVE_MESSAGE_MAX) return EMSGSIZE;
+    if (buffer_reserve(out, out->len + n) != 0) return ENOMEM;
+    memcpy(out->data + out->len, line, n);
+    out->len += n;
+    return 0;
 }
 
+int buffer_reserve(struct serve_buffer *buf, size_t len) {
+    if (len <= buf->cap) return 0;
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < len) cap *= 2;
+    char *grown = realloc(buf->data, cap);
+    if (grown == NULL) return 1;
+    buf->data = grown;
+    buf->cap = cap;
+    return 0;
+}
 
-uint32_t get_next_cluster(int fd, uint32_t cluster, uint16_t reserved_sector_count) {
-    unsigned char sector[SECTORSIZE];
-    uint32_t fat_offset = cluster * 4;
-
-    uint32_t sector_number = reserved_sector_count + (fat_offset / SECTORSIZE);
-    uint32_t entry_offset = fat_offset % SECTORSIZE;
-
-    if (readsector(fd, sector, sector_number) != 0) {
-        perror("Failed to read FAT sector");
-        return FAT_EOC;
+// Read exactly 'len' bytes; 1 on end of stream or error
+int recv_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = recv(fd, (char *)buf + done, len - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        done += n;
     }
-
-    uint32_t next_cluster = *(uint32_t *)(sector + entry_offset) & 0x0FFFFFFF;
-    return next_cluster;
+    return 0;
 }
 
-uint32_t get_file_size(int fd, uint32_t start_cluster) {
-    uint32_t cluster = start_cluster;
-    uint32_t size = 0;
-
-    while (cluster < FAT_EOC) {
-        size += CLUSTERSIZE;
-        cluster = get_next_cluster(fd, cluster, reserved_sector_count);
+int send_reply(int fd, int32_t status, const struct serve_buffer *out) {
+    uint32_t len = sizeof(status) + out->len;
+    struct iovec iov[3] = {
+        { &len, sizeof(len) },
+        { &status, sizeof(status) },
+        { out->data, out->len },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = out->len ? 3 : 2 };
+    size_t left = sizeof(len) + len;
+    while (left > 0) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        left -= n;
+        // Skip whatever the partial send took
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
     }
-
-    return size;
+    return 0;
 }
 
 void print_help() {
     printf("Usage: fatmod DISKIMAGE [option] [arguments]\n");
+    printf("       fatmod --serve SOCKETPATH DISKIMAGE...\n");
+    printf("Global options:\n");
+    printf("  --sync-each           Write through and fsync after every sector write\n");
+    printf("  --mmap                Map the image into memory and access it in place\n");
+    printf("  --punch-holes         Deallocate freed clusters in the host file on commit\n");
+    printf("  --stats[=json]        Print I/O counters and latency histograms to stderr\n");
+    printf("  --io-engine=ENGINE    Queue reads with uring (default), threads or sync\n");
+    printf("  --track-changes       Record which parts of the image change, for -export-delta\n");
+    printf("  --overlay OVERLAYFILE Leave DISKIMAGE untouched and keep every change in\n");
+    printf("                        OVERLAYFILE, a sparse file created on first use\n");
+    printf("  --serve SOCKETPATH    Keep the images open and answer requests on a Unix\n");
+    printf("                        socket until SIGINT or SIGTERM\n");
     printf("Options:\n");
-    printf("  -l                    List files in the root directory\n");
+    printf("  -l [DIRECTORY]        List files in the root directory or DIRECTORY\n");
     printf("  -r -a FILENAME        Display the content of FILENAME in ASCII form\n");
     printf("  -r -b FILENAME        Display the content of FILENAME in binary form\n");
-    printf("  -c FILENAME           Create a file named FILENAME in the root directory\n");
+    printf("  -r -raw FILENAME      Copy the content of FILENAME to stdout unformatted\n");
+    printf("  -r [-a|-b|-raw] -o OFFSET -n LEN FILENAME\n");
+    printf("                        Display only LEN bytes of FILENAME from OFFSET\n");
+    printf("  -c FILENAME           Create an empty file named FILENAME\n");
     printf("  -d FILENAME           Delete a file named FILENAME\n");
     printf("  -w FILENAME OFFSET N DATA\n");
     printf("                        Write DATA byte N times to FILENAME starting at OFFSET\n");
+    printf("  -i HOSTFILE [NAME]    Import HOSTFILE as NAME, stored as contiguously as possible\n");
+    printf("  -I MANIFEST           Import the files listed in MANIFEST (- for stdin), one\n");
+    printf("                        \"HOSTFILE [NAME]\" per line, several at a time\n");
+    printf("  -x DESTDIR [FILES...] Extract FILES, or every file, into DESTDIR in parallel\n");
+    printf("  -commit               Merge the --overlay file into DISKIMAGE and empty it\n");
+    printf("  -pack OUTFILE         Save the image compressed to OUTFILE, which fatmod can\n");
+    printf("                        then open in place (read-only, or with --overlay)\n");
+    printf("  -export-delta SINCE OUTFILE\n");
+    printf("                        Save everything changed after generation SINCE to\n");
+    printf("                        OUTFILE (- for stdout) and start a new generation;\n");
+    printf("                        SINCE 0 saves every block changed since the change\n");
+    printf("                        map was created, not the whole image\n");
+    printf("  -apply-delta DELTAFILE\n");
+    printf("                        Replay DELTAFILE onto DISKIMAGE, a copy of the image\n");
+    printf("                        the delta came from\n");
+    printf("  -defrag               Make every fragmented file one contiguous extent\n");
+    printf("  -check [--repair]     Check the FAT and directory tree for consistency\n");
+    printf("  -b SCRIPTFILE         Run the commands in SCRIPTFILE (- for stdin), one per\n");
+    printf("                        line, against the image and commit them together\n");
     printf("  -h                    Display this help message\n");
-}
-
-struct msdos_dir_entry* find_file_entry(int fd, const char *filename) {
-    if (readsector(fd, cluster, root_cluster_start_sector) != 0) {
-        perror("Failed to read root directory cluster");
-        return NULL;
-    }
-
-    dep = (struct msdos_dir_entry *)cluster;
-
-    char uppercase_filename[13];
-    strncpy(uppercase_filename, filename, sizeof(uppercase_filename) - 1);
-    uppercase_filename[sizeof(uppercase_filename) - 1] = '\0';
-    to_uppercase(uppercase_filename);
-
-    for (int i = 0; i < CLUSTERSIZE / sizeof(struct msdos_dir_entry); ++i) {
-        if (dep->name[0] == 0x00) break;
-        if (dep->name[0] != 0xE5) {
-            char name[9];
-            char ext[4];
-            strncpy(name, (char *)dep->name, 8);
-            name[8] = '\0';
-            strncpy(ext, (char *)dep->name + 8, 3);
-            ext[3] = '\0';
-
-            for (int j = 7; j >= 0 && name[j] == ' '; j--) {
-                name[j] = '\0';
-            }
-            for (int j = 2; j >= 0 && ext[j] == ' '; j--) {
-                ext[j] = '\0';
-            }
-
-            char fullname[13];
-            if (strlen(ext) > 0) {
-                snprintf(fullname, sizeof(fullname), "%s.%s", name, ext);
-            } else {
-                snprintf(fullname, sizeof(fullname), "%s", name);
-            }
-
-            to_uppercase(fullname);
-
-            if (strcmp(fullname, uppercase_filename) == 0) {
-                return dep;
-            }
-        }
-        dep++;
-    }
-
-    return NULL;
-}
-void read_boot_sector(int fd) {
-    if (readsector(fd, sector, 0) != 0) {
-        perror("Failed to read boot sector");
-        exit(1);
-    }
-
-    reserved_sector_count = *(uint16_t *)(sector + 14);
-    num_fats = *(uint8_t *)(sector + 16);
-    sectors_per_fat = *(uint32_t *)(sector + 36);
-    root_cluster_start_sector = reserved_sector_count + (num_fats * sectors_per_fat);
-}
-
-void to_uppercase(char *str) {
-    while (*str) {
-        *str = toupper((unsigned char)*str);
-        str++;
-    }
+    printf("Notes:\n");
+    printf("  FILENAME and NAME may be a path through subdirectories, such as A/B/FILE.TXT.\n");
+    printf("  Each part must be an 8.3 name: up to 8 characters, optionally followed by a\n");
+    printf("  dot and up to 3 more. Longer names are rejected, not truncated, and so are\n");
+    printf("  control characters, spaces and any of \" * + , / : ; < = > ? [ \\ ] |\n");
 }
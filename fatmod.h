@@ -0,0 +1,95 @@
+#ifndef FATMOD_H
+#define FATMOD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// libfatmod: FAT32 image access through per-image handles. Every call on
+// a volume takes its readers-writer lock, so any number of threads may
+// use one volume and any number of volumes may be open in one process.
+// Reads (listing, dumps, file reads, extraction, checks) run in parallel;
+// anything that changes the image runs alone. Changes stay in memory
+// until fat_flush() or fat_close() commits them.
+
+struct fat_volume;
+struct fat_file;
+
+// fat_open() flags
+#define FAT_OPEN_SYNC_EACH   0x01   // write through and fsync every sector write
+#define FAT_OPEN_MMAP        0x02   // map the image and access sectors in place
+#define FAT_OPEN_STATS       0x04   // time I/O for the latency histograms
+#define FAT_OPEN_IO_THREADS  0x10   // queue reads on pread() threads instead of io_uring
+#define FAT_OPEN_IO_SYNC     0x20   // read synchronously, one request at a time
+#define FAT_OPEN_PUNCH_HOLES 0x40   // deallocate freed clusters in the host file
+#define FAT_OPEN_TRACK_CHANGES 0x80 // start a change map for -export-delta
+
+// fat_dump() formats
+#define FAT_DUMP_ASCII 0            // bytes as they are, followed by a newline
+#define FAT_DUMP_HEX   1            // "%08x: " offset headers and hex bytes
+#define FAT_DUMP_RAW   2            // bytes unformatted, sendfile() where possible
+
+// fat_file_open() flags
+#define FAT_FILE_CREATE 0x01        // create an empty file if none exists
+#define FAT_FILE_EXCL   0x02        // fail with EEXIST if the file exists
+
+// Volumes. fat_open() returns NULL after reporting why the image cannot
+// be used; fat_close() commits outstanding changes and returns non-zero
+// if that failed. fat_open_overlay() opens 'path' read-only and sends
+// every write to the copy-on-write file 'overlay', created if missing;
+// fat_commit() merges such an overlay into the base image.
+//
+// An image opened once with FAT_OPEN_TRACK_CHANGES keeps a change map
+// beside it (PATH.changes) that stamps each 4 KiB it writes with the
+// current generation. fat_export_delta() saves everything written after
+// generation 'since' and starts a new generation; fat_apply_delta()
+// replays such a delta onto a copy of the image that is not open.
+//
+// fat_pack() saves the image as a packed image: compressed chunks with an
+// index, which fat_open() reads in place. Opened without an overlay, a
+// packed image is read-only: fat_read_only() returns non-zero for it, and
+// fat_file_open() with FAT_FILE_CREATE, fat_file_write() and fat_remove()
+// fail with EROFS.
+struct fat_volume *fat_open(const char *path, int flags);
+struct fat_volume *fat_open_overlay(const char *path, const char *overlay, int flags);
+int fat_flush(struct fat_volume *vol);
+int fat_close(struct fat_volume *vol);
+int fat_read_only(struct fat_volume *vol);
+void fat_print_stats(struct fat_volume *vol, FILE *out, int json);
+
+// File handles. Paths may run through subdirectories ("A/B/FILE.TXT").
+// Reads and writes return the bytes transferred or -1 with errno set; a
+// write past the end grows the file, zero filling any gap.
+struct fat_file *fat_file_open(struct fat_volume *vol, const char *path, int flags);
+ssize_t fat_file_read(struct fat_file *file, void *buf, size_t len);
+ssize_t fat_file_pread(struct fat_file *file, void *buf, size_t len, uint64_t offset);
+ssize_t fat_file_write(struct fat_file *file, const void *buf, size_t len);
+int64_t fat_file_seek(struct fat_file *file, int64_t offset, int whence);
+uint32_t fat_file_size(struct fat_file *file);
+void fat_file_close(struct fat_file *file);
+
+// Directory listing and removal without any output. fat_readdir() calls
+// 'fn' with each entry's "NAME.EXT" name until it returns non-zero, and
+// returns that value, or -1 with errno set if 'dir' (NULL for the root)
+// is not a directory. fat_remove() returns 0 or -1 with errno set.
+typedef int (*fat_dirent_fn)(const char *name, uint32_t size, int is_dir, void *arg);
+int fat_readdir(struct fat_volume *vol, const char *dir, fat_dirent_fn fn, void *arg);
+int fat_remove(struct fat_volume *vol, const char *path);
+
+// The fatmod commands. They report to stdout and return 0 on success.
+int fat_list(struct fat_volume *vol, const char *dir);
+int fat_dump(struct fat_volume *vol, const char *path, int format, uint32_t offset, uint32_t len);
+int fat_create(struct fat_volume *vol, const char *path);
+int fat_unlink(struct fat_volume *vol, const char *path);
+int fat_fill(struct fat_volume *vol, const char *path, int offset, int n, int data);
+int fat_import(struct fat_volume *vol, const char *hostfile, const char *path);
+int fat_import_list(struct fat_volume *vol, const char *manifest);
+int fat_extract(struct fat_volume *vol, const char *destdir, int nfiles, char *files[]);
+int fat_commit(struct fat_volume *vol);
+int fat_pack(struct fat_volume *vol, const char *out);
+int fat_export_delta(struct fat_volume *vol, uint32_t since, const char *out);
+int fat_apply_delta(const char *image, const char *delta);
+int fat_defragment(struct fat_volume *vol);
+int fat_check(struct fat_volume *vol, int repair);
+
+#endif
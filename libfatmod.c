@@ -0,0 +1,5365 @@
+#define _GNU_SOURCE            // fallocate()
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
+#include <linux/msdos_fs.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#include "fatmod.h"
+
+#define FALSE 0
+#define TRUE 1
+
+// Geometry limits accepted from the boot sector; the actual sizes are
+// read at run time into each volume
+#define SECTORSIZE_MIN 512       // bytes
+#define SECTORSIZE_MAX 4096      // bytes
+#define CLUSTERSIZE_MAX 65536    // bytes
+
+
+#define CACHE_BUCKETS 4096     // hash buckets of the write-back sector cache
+#define CACHE_MAX_DIRTY 65536  // write out (without fsync) beyond this many sectors
+#define FLUSH_IOVECS 1024      // iovecs per pwritev call (the kernel limit)
+#define EXTENT_IO_MIN (1024 * 1024)      // data read/write size on small-cluster volumes
+#define EXTENT_IO_MAX (4 * 1024 * 1024)  // ... and the most it grows to for large clusters
+#define EXTENT_IO_CLUSTERS 64            // clusters per request before the cap applies
+#define OUTBUF_SIZE (256 * 1024)     // formatted output buffer for -r dumps
+#define HEX_LINE_MAX 64              // longest formatted line of a -r -b dump
+#define EXTRACT_THREADS_MAX 16       // worker threads used by -x
+#define IMPORT_THREADS_MAX 16        // worker threads (and allocation zones) used by -I
+#define OVERLAY_MAGIC "FATMODOV"     // first bytes of an overlay file
+#define OVERLAY_BLOCK_SHIFT 9        // overlay granularity: the smallest sector size
+#define OVERLAY_ALIGN 4096           // the map and the data area start on this boundary
+#define CHANGES_MAGIC "FATMODCH"     // first bytes of a change map sidecar
+#define CHANGES_SUFFIX ".changes"    // appended to the image (or overlay) path
+#define CHANGES_UNIT_SHIFT 12        // change tracking granularity: 4 KiB
+#define CHANGES_PAGE 4096            // stamps start here and are written back in pages
+#define DELTA_MAGIC "FATMODDL"       // first bytes of an -export-delta file
+#define PACKED_MAGIC "FATMODPK"      // first bytes of a -pack compressed image
+#define PACKED_CHUNK_SHIFT 16        // chunks of 64 KiB are compressed independently
+#define PACKED_CACHE_CHUNKS 16       // decompressed chunks kept, least recently used out
+#define FORMAT_VERSION 1             // of overlays, change maps, deltas and packed images
+#define TREE_DEPTH_MAX 64            // deepest directory tree walk_tree() follows
+#define CHECK_THREADS_MAX 8          // threads scanning the FAT for -check
+#define CHECK_FAT_CHUNK 64           // FAT copy sectors compared per read
+#define CHECK_REPORT_MAX 50          // problems printed individually by -check
+#define ASYNC_DEPTH 8                // reads an async reader keeps in flight
+#define ASYNC_POOL_THREADS 4         // pread() threads when io_uring is unavailable
+#define CHAIN_CACHE_SIZE 8            // cluster-chain indexes kept between commands
+#define LATENCY_BUCKETS 32           // histogram buckets per --stats operation
+
+#define FAT_EOC 0x0FFFFFF8
+#define FSINFO_LEAD_SIG   0x41615252
+#define FSINFO_STRUC_SIG  0x61417272
+#define FSINFO_UNKNOWN    0xFFFFFFFF
+#define FAT_START_SECTOR 32  // Define the start sector of the FAT table
+
+// Volume geometry from the BPB. Every size is a power of two, so offset
+// math uses the shifts and masks rather than division. Building with
+// -DFATMOD_SECTOR_SHIFT=n and/or -DFATMOD_CLUSTER_SHIFT=n pins the
+// geometry at compile time: the shifts become constants the compiler
+// folds into every offset calculation, and images with any other
+// geometry are refused.
+#ifdef FATMOD_SECTOR_SHIFT
+#define SECTOR_SHIFT(vol) ((unsigned int)FATMOD_SECTOR_SHIFT)
+#else
+#define SECTOR_SHIFT(vol) ((vol)->sector_shift)
+#endif
+#ifdef FATMOD_CLUSTER_SHIFT
+#define CLUSTER_SHIFT(vol) ((unsigned int)FATMOD_CLUSTER_SHIFT)
+#else
+#define CLUSTER_SHIFT(vol) ((vol)->cluster_shift)
+#endif
+#define SECTOR_BYTES(vol) (1U << SECTOR_SHIFT(vol))
+#define SECTOR_MASK(vol) (SECTOR_BYTES(vol) - 1)
+#define CLUSTER_BYTES(vol) (1U << CLUSTER_SHIFT(vol))
+#define CLUSTER_MASK(vol) (CLUSTER_BYTES(vol) - 1)
+#define SPC_SHIFT(vol) (CLUSTER_SHIFT(vol) - SECTOR_SHIFT(vol))     // log2(sectors per cluster)
+#define SECTORS_PER_CLUSTER(vol) (1U << SPC_SHIFT(vol))
+
+// Write-back cache of dirty sectors, keyed by sector number
+struct cached_sector {
+    uint32_t snum;
+    struct cached_sector *next;   // hash chain
+    unsigned char data[];         // sector_size bytes
+};
+
+// How stream reads and FAT loading keep several reads in flight
+#define IO_ENGINE_SYNC 0
+#define IO_ENGINE_THREADS 1
+#define IO_ENGINE_URING 2
+
+// I/O instrumentation reported by fat_print_stats(). Building with
+// -DFATMOD_NO_STATS turns every STAT_* hook into nothing.
+enum stat_op {
+    OP_SECTOR_READ,               // pread/sendfile/memcpy from the image
+    OP_SECTOR_WRITE,              // pwrite/memcpy to the image
+    OP_CACHE_FLUSH,               // one flush_cache() pass
+    OP_FSYNC,                     // fsync()/msync() barrier
+    OP_ALLOCATE,                  // one allocate_cluster_run() call
+    OP_COUNT
+};
+
+// Power-of-two latency buckets: bucket i holds times in [2^i, 2^(i+1)) ns
+struct latency_hist {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+
+struct io_counters {
+    uint64_t sector_reads;        // sectors transferred from the image
+    uint64_t sector_writes;       // sectors transferred to the image
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t fsyncs;              // fsync()/msync() barriers
+    uint64_t fat_lookups;         // get_next_cluster() calls
+    uint64_t fat_updates;         // set_next_cluster() calls
+    uint64_t cache_hits;          // sector reads served by the write-back cache
+    uint64_t cache_misses;        // sector reads that went to the image
+    uint64_t allocations;         // allocate_cluster_run() calls
+    uint64_t alloc_scanned;       // clusters the allocator stepped over or took
+    uint64_t bytes_punched;       // freed bytes deallocated on the host
+    uint64_t chunks_inflated;     // packed image chunks read and decompressed
+    uint64_t chunk_hits;          // packed image reads served by decompressed chunks
+    struct latency_hist latency[OP_COUNT];
+};
+
+#ifndef FATMOD_NO_STATS
+static const char *stat_op_names[OP_COUNT] = {
+    "sector_read", "sector_write", "cache_flush", "fsync", "allocate"
+};
+
+// Concurrent readers update the counters of one volume
+#define STAT_ADD(vol, field, n) __atomic_fetch_add(&(vol)->stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_TIMER(vol, t) uint64_t t = ((vol)->flags & FAT_OPEN_STATS) ? stats_clock() : 0
+#define STAT_LATENCY(vol, op, t) record_latency(vol, op, t)
+#else
+#define STAT_ADD(vol, field, n) ((void)0)
+#define STAT_TIMER(vol, t) ((void)0)
+#define STAT_LATENCY(vol, op, t) ((void)0)
+#endif
+
+// A run of physically contiguous clusters within a cluster chain
+struct extent {
+    uint32_t start;   // first cluster of the run
+    uint32_t count;   // number of clusters in the run
+};
+
+// A file's chain as extents plus the file cluster at which each begins,
+// so the cluster holding a byte offset is found by binary search rather
+// than by walking the FAT from the start cluster
+struct chain_index {
+    uint32_t start_cluster;
+    uint64_t generation;         // fat_generation when the index was built
+    struct extent *extents;
+    uint32_t *first;             // first[i]: file cluster number of extents[i].start
+    int count;
+    uint32_t nclusters;
+    int users;                   // get_chain_index() callers still holding it
+};
+
+// A directory loaded in full, with a hash index over its raw 8.3 names
+struct dir_index {
+    uint32_t start_cluster;
+    uint32_t *clusters;          // the directory's cluster chain
+    uint32_t nclusters;
+    unsigned char *data;         // nclusters * cluster_size bytes of entries
+    uint32_t capacity;           // entry slots in 'data'
+    uint32_t end;                // first never-used (0x00) slot
+    uint32_t free_hint;          // no free slot below this index
+    int32_t *buckets;            // hash heads, -1 when empty
+    int32_t *next;               // per-entry hash chain
+    uint32_t nbuckets;           // power of two
+    struct dir_index *link;      // next loaded directory
+};
+
+// On-disk head of an overlay file, little-endian. The block map (one bit
+// per block, set when the overlay holds it) starts at map_offset; block b
+// is stored at data_offset + (b << block_shift), so the file stays sparse.
+struct overlay_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_shift;
+    uint64_t base_size;          // bytes in the base image
+    uint64_t map_offset;
+    uint64_t data_offset;
+};
+
+// FAT_OPEN with an overlay: the base image is only read, and every write
+// lands in the overlay file instead
+struct overlay {
+    int fd;
+    char *base_path;             // reopened for writing by fat_commit()
+    uint64_t base_size;
+    uint64_t nblocks;
+    uint64_t map_offset;
+    uint64_t data_offset;
+    size_t map_bytes;
+    unsigned char *map;          // the block map, held in memory
+    unsigned char *map_dirty;    // one flag per OVERLAY_ALIGN bytes of map to write back
+};
+
+// On-disk head of a change map, little-endian. It is followed, at
+// CHANGES_PAGE, by one uint32_t per unit of the image: the generation
+// in which the unit was last written, or 0 if it has not changed since
+// tracking began.
+struct changes_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t unit_shift;
+    uint64_t image_size;
+    uint32_t generation;         // what writes are stamped with now
+    uint32_t pad;
+};
+
+struct change_map {
+    int fd;
+    uint64_t image_size;
+    uint64_t nunits;
+    uint32_t generation;
+    uint32_t *stamps;            // held in memory, little-endian as on disk
+    unsigned char *page_dirty;   // one flag per CHANGES_PAGE bytes of stamps
+    int header_dirty;
+};
+
+// On-disk head of an -export-delta file, little-endian. Records follow,
+// each a struct delta_record and 'length' bytes to write at 'offset',
+// and a record of length 0 ends the file.
+struct delta_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    uint64_t image_size;
+    uint32_t since;              // changes after this generation...
+    uint32_t until;              // ...up to and including this one
+};
+
+struct delta_record {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t pad;
+};
+
+// On-disk head of a packed image, little-endian. It is followed by
+// nchunks + 1 file offsets: chunk i is stored in [index[i], index[i+1]),
+// deflated, or verbatim if that is no smaller. An empty chunk is all zeros.
+struct packed_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_shift;
+    uint64_t image_size;
+    uint64_t nchunks;
+};
+
+struct packed_chunk {
+    uint64_t chunk;              // which chunk 'data' holds
+    uint64_t used;               // tick of the last read, 0 if the slot is empty
+    unsigned char *data;
+};
+
+struct packed_image {
+    uint64_t image_size;         // of the image as unpacked
+    uint64_t nchunks;
+    uint64_t *index;             // host byte order
+    unsigned char *inbuf;        // one chunk as stored
+    pthread_mutex_t lock;        // the cache below and inbuf
+    uint64_t tick;
+    struct packed_chunk cache[PACKED_CACHE_CHUNKS];
+};
+
+// Everything known about one open image. Fields below 'lock' change only
+// under its write side, except the caches readers fill, which have their
+// own mutexes, and the counters, which are updated atomically.
+struct fat_volume {
+    int fd;
+    int flags;                   // FAT_OPEN_*
+    int sync_each;               // write through and fsync every write
+    int io_engine;
+    pthread_rwlock_t lock;
+
+#ifndef FATMOD_SECTOR_SHIFT
+    unsigned int sector_shift;
+#endif
+#ifndef FATMOD_CLUSTER_SHIFT
+    unsigned int cluster_shift;
+#endif
+    uint32_t extent_io_max;      // largest single data read/write, in bytes
+    uint16_t reserved_sector_count;
+    uint8_t num_fats;
+    uint32_t sectors_per_fat;
+    uint32_t root_cluster_start_sector;
+    uint32_t root_cluster;       // first cluster of the root directory chain
+    uint32_t total_sectors;
+    uint32_t cluster_count;      // number of addressable clusters + 2 (FAT index limit)
+
+    // In-memory copy of the first FAT, loaded once after the boot sector
+    uint32_t *fat_table;
+    unsigned char *fat_dirty;    // one flag per FAT sector that must be written back
+
+    // Free-cluster allocator state, built from the FAT and the FSInfo sector
+    uint64_t *free_map;          // bit set = cluster is free
+    uint32_t free_count;
+    uint32_t next_free_hint;
+    uint16_t fsinfo_sector;
+    int fsinfo_valid;
+    int fsinfo_dirty;
+
+    struct cached_sector *sector_cache[CACHE_BUCKETS];
+    uint32_t cache_dirty_count;
+    int needs_sync;              // written to since the last durability barrier
+
+    // FAT_OPEN_PUNCH_HOLES: runs freed since the last flush, punched out of
+    // the host file once the FAT on disk no longer references them
+    struct extent *freed;
+    uint32_t freed_count;
+    uint32_t freed_cap;
+
+    // FAT_OPEN_MMAP: the whole image mapped once; sectors are accessed in place
+    unsigned char *image_map;
+    size_t image_size;
+    int fat_in_place;            // fat_table points into image_map
+
+    struct overlay *overlay;     // copy-on-write overlay, or NULL
+    struct packed_image *packed; // the image is a read-only packed image, or NULL
+    struct change_map *changes;  // generation stamps of written units, or NULL
+
+    // Indexes of recently used chains, dropped as soon as the FAT changes
+    pthread_mutex_t chain_lock;
+    struct chain_index chain_cache[CHAIN_CACHE_SIZE];
+    int chain_cache_next;
+    uint64_t fat_generation;     // bumped by every set_next_cluster()
+
+    pthread_mutex_t dir_lock;
+    struct dir_index *dir_cache; // every directory loaded so far
+
+    pthread_mutex_t ring_lock;
+    struct io_ring *idle_rings;  // io_uring instances set up earlier, free for reuse
+
+    struct io_counters stats;
+};
+
+// An open file: its directory entry, which stays valid because loaded
+// directories are kept until the volume is closed
+struct fat_file {
+    struct fat_volume *vol;
+    struct dir_index *dir;
+    uint32_t entry;              // entry index within 'dir'
+    uint64_t pos;
+};
+
+// One file to copy out of the image with -x
+struct extract_job {
+    uint32_t start_cluster;
+    uint32_t size;
+    char *host_path;
+    int failed;
+};
+struct extract_list {
+    struct fat_volume *vol;
+    struct extract_job *jobs;
+    int count;
+    int capacity;
+    int next;                    // next job to claim, shared by the workers
+};
+
+// One file to copy into the image with -I. Workers fill in the chain;
+// the directory entry is added afterwards, in manifest order.
+struct import_job {
+    char *host_path;
+    char *name;                  // path in the image
+    uint32_t start_cluster;
+    uint32_t size;
+    int extents;
+    int state;                   // IMPORT_*
+};
+
+enum { IMPORT_PENDING, IMPORT_WRITTEN, IMPORT_DEFERRED, IMPORT_FAILED };
+
+// A slice of the cluster space that only one -I worker allocates from.
+// Its bounds are multiples of a FAT sector's worth of clusters (at least
+// 64), so no two zones share a free-map word or a FAT dirty flag.
+struct import_zone {
+    struct import_list *list;
+    uint32_t start, end;
+    uint32_t next;               // where the next search starts
+    uint32_t free;               // free clusters left in the zone
+    uint32_t claimed;            // clusters taken for files, net of failures
+    uint32_t allocations;
+};
+
+struct import_list {
+    struct fat_volume *vol;
+    struct import_job *jobs;
+    int count;
+    int capacity;
+    int next;                    // next job to claim, shared by the workers
+};
+
+// A chain reachable from the directory tree, as seen by -defrag
+struct chain_info {
+    struct dir_index *dir;       // directory holding the entry
+    uint32_t entry;              // entry index within that directory
+    uint32_t start;
+    uint32_t clusters;
+    int extents;
+    int is_dir;
+};
+struct chain_list {
+    struct chain_info *chains;
+    int count;
+    int capacity;
+};
+
+// Per-thread slice of the -check FAT scan and its results
+struct fat_scan {
+    struct fat_volume *vol;
+    uint32_t first, last;            // clusters [first, last)
+    uint32_t sec_first, sec_last;    // FAT sectors compared across copies
+    uint32_t free, eoc, bad, invalid;
+    uint32_t diverged;               // sectors differing from the first FAT
+};
+
+// Findings of the -check directory walk
+struct check_state {
+    struct fat_volume *vol;
+    int repair;
+    uint32_t *owner;                 // id of the chain that reached each cluster
+    uint32_t next_id;
+    uint32_t dirs, files, used;
+    uint32_t cross_links, cycles, bad_pointers, size_mismatches;
+    uint32_t lost_chains, lost_clusters;
+    uint32_t problems;
+};
+
+// Formatted output of a -r -b dump, handed to stdio in big chunks
+struct hex_output {
+    unsigned char buf[OUTBUF_SIZE];
+    size_t len;
+};
+
+// Called by walk_tree() for every entry; 'path' is the entry's path under
+// the walk prefix. Non-zero reports failure and skips a directory's contents.
+typedef int (*tree_visit_fn)(struct fat_volume *vol, struct dir_index *dir, struct msdos_dir_entry *entry,
+                             const char *path, void *arg);
+
+// Receives file data in order; returns non-zero to stop streaming
+typedef int (*file_chunk_fn)(const unsigned char *data, size_t len, uint32_t offset, void *arg);
+
+// Function declarations
+static int readsector(struct fat_volume *vol, unsigned char *buf, unsigned int snum);
+static int writesector(struct fat_volume *vol, unsigned char *buf, unsigned int snum);
+static int readsectors(struct fat_volume *vol, unsigned char *buf, unsigned int snum, unsigned int count);
+static int writesectors(struct fat_volume *vol, unsigned char *buf, unsigned int snum, unsigned int count);
+static unsigned char *map_sectors(struct fat_volume *vol, unsigned char *buf, unsigned int snum, unsigned int count);
+static int map_image(struct fat_volume *vol);
+static ssize_t image_pread(struct fat_volume *vol, void *buf, size_t len, off_t offset);
+static ssize_t base_pread(struct fat_volume *vol, void *buf, size_t len, off_t offset);
+static int image_length(struct fat_volume *vol, uint64_t *size);
+static ssize_t image_pwrite(struct fat_volume *vol, const void *buf, size_t len, off_t offset);
+static ssize_t image_pwritev(struct fat_volume *vol, const struct iovec *iov, int iovcnt, off_t offset);
+static int image_fsync(struct fat_volume *vol);
+static int image_punch(struct fat_volume *vol, off_t offset, off_t len);
+static int overlay_open(struct fat_volume *vol, const char *base_path, const char *path);
+static void overlay_close(struct overlay *ov);
+static int overlay_has(const struct overlay *ov, uint64_t block);
+static void overlay_mark(struct overlay *ov, off_t offset, size_t len, int present);
+static int overlay_write_map(struct overlay *ov);
+static int commit_overlay(struct fat_volume *vol);
+static struct change_map *changes_open(const char *image_path, uint64_t image_size, int create);
+static void changes_close(struct change_map *cm);
+static int changes_mark(struct change_map *cm, off_t offset, size_t len);
+static int changes_sync(struct change_map *cm);
+static int changes_stamp(struct change_map *cm, off_t offset, size_t len);
+static int export_delta(struct fat_volume *vol, uint32_t since, const char *outpath);
+static int packed_open(struct fat_volume *vol);
+static int image_is_packed(int fd);
+static void packed_close(struct packed_image *pk);
+static ssize_t packed_pread(struct fat_volume *vol, void *buf, size_t len, off_t offset);
+static int pack_image(struct fat_volume *vol, const char *outpath);
+struct async_reader;
+static int async_init(struct async_reader *ar, struct fat_volume *vol);
+static int async_submit(struct async_reader *ar, int i, unsigned char *buf, unsigned int snum, unsigned int count);
+static int async_wait(struct async_reader *ar, int i);
+static void async_destroy(struct async_reader *ar);
+static int read_sectors_parallel(struct fat_volume *vol, unsigned char *buf, unsigned int snum, unsigned int count);
+static int flush_cache(struct fat_volume *vol);
+static void stamp_pending(struct fat_volume *vol);
+static int flush_image(struct fat_volume *vol);
+static int writecluster(struct fat_volume *vol, unsigned char *buf, unsigned int cnum);
+static int readextent(struct fat_volume *vol, unsigned char *buf, uint32_t start, uint32_t count);
+static int writeextent(struct fat_volume *vol, unsigned char *buf, uint32_t start, uint32_t count);
+static int get_chain_extents(struct fat_volume *vol, uint32_t start_cluster, struct extent **extents);
+static int build_chain_index(struct fat_volume *vol, uint32_t start_cluster, struct chain_index *ci);
+static void free_chain_index(struct chain_index *ci);
+static struct chain_index *get_chain_index(struct fat_volume *vol, uint32_t start_cluster);
+static void put_chain_index(struct fat_volume *vol, struct chain_index *ci);
+static int chain_index_find(const struct chain_index *ci, uint32_t file_cluster);
+static int stream_range(struct fat_volume *vol, const struct chain_index *ci, uint32_t offset, uint32_t len,
+                        file_chunk_fn fn, void *arg);
+static int stream_file(struct fat_volume *vol, uint32_t start_cluster, uint32_t file_size, file_chunk_fn fn, void *arg);
+static struct dir_index *open_directory(struct fat_volume *vol, const char *path);
+static int list_directory(struct fat_volume *vol, const char *path);
+static int display_file_ascii(struct fat_volume *vol, const char *filename, uint32_t offset, uint32_t len);
+static int display_file_binary(struct fat_volume *vol, const char *filename, uint32_t offset, uint32_t len);
+static int display_file_raw(struct fat_volume *vol, const char *filename, uint32_t offset, uint32_t len);
+static int create_file(struct fat_volume *vol, const char *filename);
+static int delete_file(struct fat_volume *vol, const char *filename);
+static int remove_file(struct fat_volume *vol, struct dir_index *dir, struct msdos_dir_entry *file_entry);
+static int write_to_file(struct fat_volume *vol, const char *filename, int offset, int n, int data);
+static int write_range(struct fat_volume *vol, struct dir_index *dir, struct msdos_dir_entry *file_entry,
+                       uint32_t offset, uint32_t n, const unsigned char *data, size_t pattern_len);
+static int import_file(struct fat_volume *vol, const char *hostfile, const char *filename);
+static int import_list(struct fat_volume *vol, const char *manifest);
+static int free_chain(struct fat_volume *vol, uint32_t cluster_num);
+static uint32_t get_next_cluster(struct fat_volume *vol, uint32_t cluster);
+static int extract_files(struct fat_volume *vol, const char *destdir, int nfiles, char *files[]);
+static void format_83_name(const unsigned char *raw, char out[13]);
+static int walk_tree(struct fat_volume *vol, uint32_t start, const char *prefix, int depth, tree_visit_fn fn, void *arg);
+static int defragment(struct fat_volume *vol);
+static int check_image(struct fat_volume *vol, int repair);
+static uint32_t allocate_cluster_run(struct fat_volume *vol, uint32_t want, uint32_t *got);
+static uint32_t find_free_run(struct fat_volume *vol, uint32_t want, uint32_t *len);
+static uint32_t scan_free_map(struct fat_volume *vol, uint32_t from, uint32_t limit, int want_free);
+static void claim_cluster_run(struct fat_volume *vol, uint32_t start, uint32_t len);
+static int set_next_cluster(struct fat_volume *vol, uint32_t cluster, uint32_t next_cluster);
+static struct msdos_dir_entry *find_file_entry(struct fat_volume *vol, const char *filename, struct dir_index **dirp);
+static int make_83_name(const char *component, size_t len, unsigned char out[11]);
+static int valid_83_char(unsigned char c);
+static int entry_is_indexed(const struct msdos_dir_entry *e);
+static struct dir_index *load_dir(struct fat_volume *vol, uint32_t start_cluster);
+static void free_dir(struct dir_index *dir);
+static struct dir_index *resolve_parent(struct fat_volume *vol, const char *path, unsigned char name[11]);
+static const char *resolve_error(int err);
+static struct msdos_dir_entry *dir_lookup(struct dir_index *dir, const unsigned char name[11]);
+static struct msdos_dir_entry *dir_add_entry(struct fat_volume *vol, struct dir_index *dir, const unsigned char name[11]);
+static void dir_remove_entry(struct dir_index *dir, struct msdos_dir_entry *entry);
+static int dir_write_entry(struct fat_volume *vol, struct dir_index *dir, struct msdos_dir_entry *entry);
+static int read_boot_sector(struct fat_volume *vol);
+static int load_fat(struct fat_volume *vol);
+static int flush_fat(struct fat_volume *vol);
+static int build_free_map(struct fat_volume *vol);
+static int flush_fsinfo(struct fat_volume *vol);
+static void note_freed_cluster(struct fat_volume *vol, uint32_t cluster);
+static int punch_freed(struct fat_volume *vol);
+#ifndef FATMOD_NO_STATS
+static uint64_t stats_clock();
+static void record_latency(struct fat_volume *vol, enum stat_op op, uint64_t start);
+#endif
+
+static struct cached_sector *cache_lookup(struct fat_volume *vol, unsigned int snum) {
+    struct cached_sector *cs = vol->sector_cache[snum % CACHE_BUCKETS];
+    while (cs != NULL && cs->snum != snum) {
+        cs = cs->next;
+    }
+    return cs;
+}
+
+// Drop cached copies of sectors that are about to be overwritten on disk
+static void cache_invalidate(struct fat_volume *vol, unsigned int snum, unsigned int count) {
+    if (vol->cache_dirty_count == 0) return;
+    for (unsigned int s = snum; s < snum + count; s++) {
+        struct cached_sector **pp = &vol->sector_cache[s % CACHE_BUCKETS];
+        while (*pp != NULL) {
+            if ((*pp)->snum == s) {
+                struct cached_sector *victim = *pp;
+                *pp = victim->next;
+                free(victim);
+                vol->cache_dirty_count--;
+                break;
+            }
+            pp = &(*pp)->next;
+        }
+    }
+}
+
+static int readsector(struct fat_volume *vol, unsigned char *buf, unsigned int snum) {
+    off_t offset;
+    int n;
+
+    if (vol->image_map != NULL) {
+        return readsectors(vol, buf, snum, 1);
+    }
+
+    struct cached_sector *cs = cache_lookup(vol, snum);
+    if (cs != NULL) {
+        memcpy(buf, cs->data, SECTOR_BYTES(vol));
+        STAT_ADD(vol, cache_hits, 1);
+        return 0;
+    }
+
+    STAT_TIMER(vol, t);
+    offset = (off_t)snum << SECTOR_SHIFT(vol);
+    n = image_pread(vol, buf, SECTOR_BYTES(vol), offset);
+    STAT_LATENCY(vol, OP_SECTOR_READ, t);
+    STAT_ADD(vol, cache_misses, 1);
+    STAT_ADD(vol, sector_reads, 1);
+    STAT_ADD(vol, bytes_read, SECTOR_BYTES(vol));
+    if (n != SECTOR_BYTES(vol)) {
+        if (n >= 0) errno = EIO;    // short read: past the end of the image
+        return 1;
+    }
+    return 0;
+}
+
+static int writesector(struct fat_volume *vol, unsigned char *buf, unsigned int snum) {
+    off_t offset;
+    int n;
+
+    if (vol->image_map != NULL) {
+        return writesectors(vol, buf, snum, 1);
+    }
+
+    vol->needs_sync = TRUE;
+    if (vol->sync_each) {
+        offset = (off_t)snum << SECTOR_SHIFT(vol);
+        STAT_TIMER(vol, t);
+        n = image_pwrite(vol, buf, SECTOR_BYTES(vol), offset);
+        STAT_LATENCY(vol, OP_SECTOR_WRITE, t);
+        if (n != SECTOR_BYTES(vol)) {
+            if (n >= 0) errno = EIO;
+            return 1;
+        }
+        STAT_TIMER(vol, ts);
+        int synced = image_fsync(vol);
+        STAT_LATENCY(vol, OP_FSYNC, ts);
+        STAT_ADD(vol, sector_writes, 1);
+        STAT_ADD(vol, bytes_written, SECTOR_BYTES(vol));
+        STAT_ADD(vol, fsyncs, 1);
+        // A writeback error is reported once, so a failed barrier must fail the write
+        return synced != 0;
+    }
+
+    struct cached_sector *cs = cache_lookup(vol, snum);
+    if (cs == NULL) {
+        if (vol->cache_dirty_count >= CACHE_MAX_DIRTY && flush_cache(vol) != 0) {
+            return 1;
+        }
+        cs = malloc(sizeof(struct cached_sector) + SECTOR_BYTES(vol));
+        if (cs == NULL) return 1;
+        cs->snum = snum;
+        cs->next = vol->sector_cache[snum % CACHE_BUCKETS];
+        vol->sector_cache[snum % CACHE_BUCKETS] = cs;
+        vol->cache_dirty_count++;
+    }
+    memcpy(cs->data, buf, SECTOR_BYTES(vol));
+    return 0;
+}
+
+static void cache_overlay(struct fat_volume *vol, unsigned char *buf, unsigned int snum, unsigned int count);
+
+static int readsectors(struct fat_volume *vol, unsigned char *buf, unsigned int snum, unsigned int count) {
+    off_t offset = (off_t)snum << SECTOR_SHIFT(vol);
+    size_t len = (size_t)count << SECTOR_SHIFT(vol);
+    size_t done = 0;
+
+    if (vol->image_map != NULL) {
+        if (offset + len > vol->image_size) return 1;
+        STAT_TIMER(vol, t);
+        memcpy(buf, vol->image_map + offset, len);
+        STAT_LATENCY(vol, OP_SECTOR_READ, t);
+        STAT_ADD(vol, sector_reads, count);
+        STAT_ADD(vol, bytes_read, len);
+        return 0;
+    }
+    STAT_TIMER(vol, t);
+    while (done < len) {
+        ssize_t n = image_pread(vol, buf + done, len - done, offset + done);
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return 1;
+        }
+        done += n;
+    }
+    STAT_LATENCY(vol, OP_SECTOR_READ, t);
+    STAT_ADD(vol, sector_reads, count);
+    STAT_ADD(vol, bytes_read, len);
+
+    cache_overlay(vol, buf, snum, count);
+    return 0;
+}
+
+// Dirty sectors in the cache are newer than what is on disk
+static void cache_overlay(struct fat_volume *vol, unsigned char *buf, unsigned int snum, unsigned int count) {
+    if (vol->cache_dirty_count == 0) return;
+    for (unsigned int i = 0; i < count; i++) {
+        struct cached_sector *cs = cache_lookup(vol, snum + i);
+        if (cs != NULL) {
+            memcpy(buf + ((size_t)i << SECTOR_SHIFT(vol)), cs->data, SECTOR_BYTES(vol));
+            STAT_ADD(vol, cache_hits, 1);
+        } else {
+            STAT_ADD(vol, cache_misses, 1);
+        }
+    }
+}
+
+static int writesectors(struct fat_volume *vol, unsigned char *buf, unsigned int snum, unsigned int count) {
+    off_t offset = (off_t)snum << SECTOR_SHIFT(vol);
+    size_t len = (size_t)count << SECTOR_SHIFT(vol);
+    size_t done = 0;
+
+    // -I workers write file data concurrently
+    __atomic_store_n(&vol->needs_sync, TRUE, __ATOMIC_RELAXED);
+    if (vol->image_map != NULL) {
+        if (offset + len > vol->image_size) return 1;
+        if (vol->changes != NULL && changes_stamp(vol->changes, offset, len) != 0) {
+            return 1;
+        }
+        // Callers that edited a pointer from map_sectors() are already done
+        STAT_TIMER(vol, t);
+        if (buf != vol->image_map + offset) {
+            memcpy(vol->image_map + offset, buf, len);
+        }
+        STAT_LATENCY(vol, OP_SECTOR_WRITE, t);
+        STAT_ADD(vol, sector_writes, count);
+        STAT_ADD(vol, bytes_written, len);
+        if (vol->sync_each) {
+            off_t page = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+            STAT_TIMER(vol, ts);
+            int synced = msync(vol->image_map + page, offset + len - page, MS_SYNC);
+            STAT_LATENCY(vol, OP_FSYNC, ts);
+            STAT_ADD(vol, fsyncs, 1);
+            if (synced != 0) return 1;
+        }
+        return 0;
+    }
+
+    cache_invalidate(vol, snum, count);
+    STAT_TIMER(vol, t);
+    while (done < len) {
+        ssize_t n = image_pwrite(vol, buf + done, len - done, offset + done);
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return 1;
+        }
+        done += n;
+    }
+    STAT_LATENCY(vol, OP_SECTOR_WRITE, t);
+    STAT_ADD(vol, sector_writes, count);
+    STAT_ADD(vol, bytes_written, len);
+    if (vol->sync_each) {
+        STAT_TIMER(vol, ts);
+        int synced = image_fsync(vol);
+        STAT_LATENCY(vol, OP_FSYNC, ts);
+        STAT_ADD(vol, fsyncs, 1);
+        if (synced != 0) return 1;
+    }
+    return 0;
+}
+
+// Return a pointer to 'count' sectors starting at 'snum': in place inside
+// the mapping in FAT_OPEN_MMAP mode, otherwise read into 'buf'. NULL on error.
+static unsigned char *map_sectors(struct fat_volume *vol, unsigned char *buf, unsigned int snum, unsigned int count) {
+    if (vol->image_map != NULL) {
+        off_t offset = (off_t)snum << SECTOR_SHIFT(vol);
+        if (offset + ((size_t)count << SECTOR_SHIFT(vol)) > vol->image_size) return NULL;
+        STAT_ADD(vol, sector_reads, count);
+        STAT_ADD(vol, bytes_read, (uint64_t)count * SECTOR_BYTES(vol));
+        return vol->image_map + offset;
+    }
+    return readsectors(vol, buf, snum, count) == 0 ? buf : NULL;
+}
+
+#ifndef FATMOD_NO_STATS
+static uint64_t stats_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Add the time since 'start' (from STAT_TIMER) to the histogram of 'op'
+static void record_latency(struct fat_volume *vol, enum stat_op op, uint64_t start) {
+    if (start == 0) return;
+    uint64_t ns = stats_clock() - start;
+    struct latency_hist *h = &vol->stats.latency[op];
+    int b = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    if (b >= LATENCY_BUCKETS) b = LATENCY_BUCKETS - 1;
+
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[b], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, TRUE,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Upper bound, in ns, of the bucket holding the given percentile
+static uint64_t latency_percentile(const struct latency_hist *h, unsigned int pct) {
+    uint64_t target = (h->count * pct + 99) / 100;
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= target && seen > 0) {
+            uint64_t bound = 2ULL << b;
+            return bound < h->max_ns ? bound : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+#endif
+
+// Print the volume's I/O counters and latency histograms to 'out', as text
+// or as one JSON object
+void fat_print_stats(struct fat_volume *vol, FILE *out, int json) {
+#ifdef FATMOD_NO_STATS
+    fprintf(out, "fatmod was built with FATMOD_NO_STATS; no statistics collected\n");
+#else
+    const struct io_counters *s = &vol->stats;
+    const char *names[] = {
+        "sector_reads", "sector_writes", "bytes_read", "bytes_written", "fsyncs",
+        "fat_lookups", "fat_updates", "cache_hits", "cache_misses",
+        "allocations", "alloc_scanned", "bytes_punched", "chunks_inflated", "chunk_hits"
+    };
+    uint64_t values[] = {
+        s->sector_reads, s->sector_writes, s->bytes_read, s->bytes_written, s->fsyncs,
+        s->fat_lookups, s->fat_updates, s->cache_hits, s->cache_misses,
+        s->allocations, s->alloc_scanned, s->bytes_punched, s->chunks_inflated, s->chunk_hits
+    };
+    int ncounters = sizeof(values) / sizeof(values[0]);
+
+    if (json) {
+        fprintf(out, "{");
+        for (int i = 0; i < ncounters; i++) {
+            fprintf(out, "\"%s\": %llu, ", names[i], (unsigned long long)values[i]);
+        }
+        fprintf(out, "\"latency_ns\": {");
+        for (int op = 0; op < OP_COUNT; op++) {
+            const struct latency_hist *h = &s->latency[op];
+            fprintf(out, "%s\"%s\": {\"count\": %llu, \"total\": %llu, \"max\": %llu, "
+                    "\"p50\": %llu, \"p99\": %llu, \"buckets\": [",
+                    op ? ", " : "", stat_op_names[op],
+                    (unsigned long long)h->count, (unsigned long long)h->total_ns,
+                    (unsigned long long)h->max_ns,
+                    (unsigned long long)latency_percentile(h, 50),
+                    (unsigned long long)latency_percentile(h, 99));
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                fprintf(out, "%s%llu", b ? ", " : "", (unsigned long long)h->buckets[b]);
+            }
+            fprintf(out, "]}");
+        }
+        fprintf(out, "}}\n");
+        return;
+    }
+
+    fprintf(out, "I/O statistics:\n");
+    for (int i = 0; i < ncounters; i++) {
+        fprintf(out, "  %-16s %12llu\n", names[i], (unsigned long long)values[i]);
+    }
+    fprintf(out, "Latency (us):      count        avg        p50        p99        max\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        const struct latency_hist *h = &s->latency[op];
+        if (h->count == 0) continue;
+        fprintf(out, "  %-12s %10llu %10.1f %10.1f %10.1f %10.1f\n", stat_op_names[op],
+                (unsigned long long)h->count, h->total_ns / 1000.0 / h->count,
+                latency_percentile(h, 50) / 1000.0, latency_percentile(h, 99) / 1000.0,
+                h->max_ns / 1000.0);
+    }
+#endif
+}
+
+// Asynchronous sector reads. A reader keeps up to ASYNC_DEPTH reads in
+// flight on one image and hands them back in submission order. The
+// engine is io_uring (driven through raw syscalls), falling back to a
+// small pool of pread() threads where io_uring is unavailable, or plain
+// synchronous reads with --io-engine=sync.
+struct async_slot {
+    struct async_reader *owner;
+    struct async_slot *next;      // thread-pool queue link
+    unsigned char *buf;
+    struct iovec iov;
+    off_t offset;
+    unsigned int snum;            // first sector of the request
+    unsigned int count;           // sectors in the request
+    int busy;                     // submitted and not yet collected
+    int done;                     // completed, 'result' is valid
+    ssize_t result;
+    uint64_t started;             // STAT_TIMER of the submission
+};
+
+// An io_uring with its rings mapped. Setting one up costs several system
+// calls and mappings, so a reader borrows one from its volume and hands it
+// back, empty, when it is done.
+struct io_ring {
+    struct io_ring *next;         // volume's idle list link
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+struct async_reader {
+    struct fat_volume *vol;
+    int engine;
+    struct async_slot slots[ASYNC_DEPTH];
+    struct io_ring *ring;         // io_uring engine only
+    int ring_failed;              // a request may be left in the ring, so drop it
+    // thread pool completions
+    pthread_mutex_t lock;
+    pthread_cond_t completed;
+};
+
+// Thread-pool fallback, shared by every reader and started on first use
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static struct async_slot *pool_head, *pool_tail;
+static int pool_started;
+
+static struct io_ring *ring_setup(void) {
+    struct io_ring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) return NULL;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, ASYNC_DEPTH, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_len > ring->sq_ring_len) ring->sq_ring_len = ring->cq_ring_len;
+        ring->cq_ring_len = ring->sq_ring_len;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_len);
+            goto fail;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_len);
+        munmap(ring->sq_ring, ring->sq_ring_len);
+        goto fail;
+    }
+
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+    return ring;
+
+fail:
+    close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+static void ring_free(struct io_ring *ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_len);
+    munmap(ring->sq_ring, ring->sq_ring_len);
+    close(ring->fd);
+    free(ring);
+}
+
+// An idle ring of 'vol', or a new one; NULL if io_uring cannot start
+static struct io_ring *ring_get(struct fat_volume *vol) {
+    pthread_mutex_lock(&vol->ring_lock);
+    struct io_ring *ring = vol->idle_rings;
+    if (ring != NULL) {
+        vol->idle_rings = ring->next;
+    }
+    pthread_mutex_unlock(&vol->ring_lock);
+    return ring != NULL ? ring : ring_setup();
+}
+
+// Give back a ring with nothing left in flight
+static void ring_put(struct fat_volume *vol, struct io_ring *ring) {
+    pthread_mutex_lock(&vol->ring_lock);
+    ring->next = vol->idle_rings;
+    vol->idle_rings = ring;
+    pthread_mutex_unlock(&vol->ring_lock);
+}
+
+static void *pool_worker(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_head == NULL) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+        }
+        struct async_slot *slot = pool_head;
+        pool_head = slot->next;
+        if (pool_head == NULL) pool_tail = NULL;
+        pthread_mutex_unlock(&pool_lock);
+
+        ssize_t done = 0;
+        while ((size_t)done < slot->iov.iov_len) {
+            ssize_t n = image_pread(slot->owner->vol, slot->buf + done, slot->iov.iov_len - done, slot->offset + done);
+            if (n <= 0) {
+                done = n < 0 ? -errno : done;
+                break;
+            }
+            done += n;
+        }
+
+        struct async_reader *ar = slot->owner;
+        pthread_mutex_lock(&ar->lock);
+        slot->result = done;
+        slot->done = TRUE;
+        pthread_cond_broadcast(&ar->completed);
+        pthread_mutex_unlock(&ar->lock);
+    }
+    return NULL;
+}
+
+static int pool_start(void) {
+    pthread_mutex_lock(&pool_lock);
+    int result = 0;
+    if (!pool_started) {
+        for (int i = 0; i < ASYNC_POOL_THREADS; i++) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, pool_worker, NULL) != 0) {
+                result = i == 0;
+                break;
+            }
+            pthread_detach(thread);
+        }
+        pool_started = result == 0;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return result;
+}
+
+// Prepare a reader on 'vol' using the configured engine, downgrading to the
+// thread pool, then to synchronous reads, when an engine cannot start
+static int async_init(struct async_reader *ar, struct fat_volume *vol) {
+    memset(ar, 0, sizeof(*ar));
+    ar->vol = vol;
+    ar->engine = __atomic_load_n(&vol->io_engine, __ATOMIC_RELAXED);
+    // The ring reads the image file directly, which an overlay or a packed
+    // image must intercept
+    if (ar->engine == IO_ENGINE_URING &&
+        (vol->overlay != NULL || vol->packed != NULL || (ar->ring = ring_get(vol)) == NULL)) {
+        ar->engine = IO_ENGINE_THREADS;
+        // No point probing again
+        __atomic_store_n(&vol->io_engine, IO_ENGINE_THREADS, __ATOMIC_RELAXED);
+    }
+    if (ar->engine == IO_ENGINE_THREADS) {
+        if (pool_start() != 0) {
+            ar->engine = IO_ENGINE_SYNC;
+        } else {
+            pthread_mutex_init(&ar->lock, NULL);
+            pthread_cond_init(&ar->completed, NULL);
+        }
+    }
+    for (int i = 0; i < ASYNC_DEPTH; i++) {
+        ar->slots[i].owner = ar;
+    }
+    return 0;
+}
+
+// Start reading 'count' sectors at 'snum' into 'buf' through slot 'i'
+static int async_submit(struct async_reader *ar, int i, unsigned char *buf, unsigned int snum, unsigned int count) {
+    struct fat_volume *vol = ar->vol;
+    struct async_slot *slot = &ar->slots[i];
+    slot->buf = buf;
+    slot->iov.iov_base = buf;
+    slot->iov.iov_len = (size_t)count << SECTOR_SHIFT(vol);
+    slot->offset = (off_t)snum << SECTOR_SHIFT(vol);
+    slot->snum = snum;
+    slot->count = count;
+    slot->busy = TRUE;
+    slot->done = FALSE;
+#ifndef FATMOD_NO_STATS
+    slot->started = (vol->flags & FAT_OPEN_STATS) ? stats_clock() : 0;
+#endif
+
+    if (ar->engine == IO_ENGINE_URING) {
+        struct io_ring *ring = ar->ring;
+        unsigned tail = *ring->sq_tail;
+        unsigned index = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = vol->fd;
+        sqe->addr = (uintptr_t)&slot->iov;
+        sqe->len = 1;
+        sqe->off = slot->offset;
+        sqe->user_data = i;
+        ring->sq_array[index] = index;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        if (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) != 1) {
+            ar->ring_failed = TRUE;
+            slot->busy = FALSE;
+            return 1;
+        }
+    } else if (ar->engine == IO_ENGINE_THREADS) {
+        pthread_mutex_lock(&pool_lock);
+        slot->next = NULL;
+        if (pool_tail != NULL) pool_tail->next = slot;
+        else pool_head = slot;
+        pool_tail = slot;
+        pthread_cond_signal(&pool_work);
+        pthread_mutex_unlock(&pool_lock);
+    } else {
+        ssize_t done = 0;
+        while ((size_t)done < slot->iov.iov_len) {
+            ssize_t n = image_pread(ar->vol, buf + done, slot->iov.iov_len - done, slot->offset + done);
+            if (n <= 0) break;
+            done += n;
+        }
+        slot->result = done;
+        slot->done = TRUE;
+    }
+    return 0;
+}
+
+// Wait for slot 'i' to complete. Returns 0 when every byte arrived; dirty
+// sectors still in the write-back cache are laid over the data read.
+static int async_wait(struct async_reader *ar, int i) {
+    struct fat_volume *vol = ar->vol;
+    struct async_slot *slot = &ar->slots[i];
+    if (!slot->busy) return 1;
+
+    if (ar->engine == IO_ENGINE_URING) {
+        struct io_ring *ring = ar->ring;
+        while (!slot->done) {
+            unsigned head = *ring->cq_head;
+            if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                    errno != EINTR) {
+                    ar->ring_failed = TRUE;
+                    slot->busy = FALSE;
+                    return 1;
+                }
+                continue;
+            }
+            // Completions may arrive in any order; park each in its slot
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            struct async_slot *finished = &ar->slots[cqe->user_data];
+            finished->result = cqe->res;
+            finished->done = TRUE;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        }
+    } else if (ar->engine == IO_ENGINE_THREADS) {
+        pthread_mutex_lock(&ar->lock);
+        while (!slot->done) {
+            pthread_cond_wait(&ar->completed, &ar->lock);
+        }
+        pthread_mutex_unlock(&ar->lock);
+    }
+    slot->busy = FALSE;
+
+    // A short read (only possible at the end of the image file) is finished
+    // synchronously; anything else is an error
+    size_t len = slot->iov.iov_len;
+    if (slot->result > 0 && (size_t)slot->result < len) {
+        ssize_t n = image_pread(ar->vol, slot->buf + slot->result, len - slot->result, slot->offset + slot->result);
+        if (n > 0) slot->result += n;
+    }
+    if (slot->result < 0 || (size_t)slot->result != len) {
+        return 1;
+    }
+#ifndef FATMOD_NO_STATS
+    record_latency(vol, OP_SECTOR_READ, slot->started);
+#endif
+    STAT_ADD(vol, sector_reads, slot->count);
+    STAT_ADD(vol, bytes_read, len);
+    cache_overlay(vol, slot->buf, slot->snum, slot->count);
+    return 0;
+}
+
+// Collect every outstanding read and release the engine's resources; the
+// ring goes back to the volume for the next reader
+static void async_destroy(struct async_reader *ar) {
+    for (int i = 0; i < ASYNC_DEPTH; i++) {
+        if (ar->slots[i].busy) {
+            async_wait(ar, i);
+        }
+    }
+    if (ar->engine == IO_ENGINE_URING && ar->ring_failed) {
+        ring_free(ar->ring);
+    } else if (ar->engine == IO_ENGINE_URING) {
+        ring_put(ar->vol, ar->ring);
+    } else if (ar->engine == IO_ENGINE_THREADS) {
+        pthread_mutex_destroy(&ar->lock);
+        pthread_cond_destroy(&ar->completed);
+    }
+}
+
+// Read 'count' contiguous sectors into 'buf' as ASYNC_DEPTH parallel requests
+static int read_sectors_parallel(struct fat_volume *vol, unsigned char *buf, unsigned int snum, unsigned int count) {
+    unsigned int per_request = vol->extent_io_max >> SECTOR_SHIFT(vol);
+    if (vol->image_map != NULL || count <= per_request) {
+        return readsectors(vol, buf, snum, count);
+    }
+
+    struct async_reader ar;
+    async_init(&ar, vol);
+    int result = 0;
+    unsigned int next = 0;      // next sector to submit, relative to 'snum'
+    unsigned int submitted = 0, collected = 0;
+    while (collected < submitted || next < count) {
+        while (next < count && submitted - collected < ASYNC_DEPTH) {
+            unsigned int n = count - next < per_request ? count - next : per_request;
+            if (async_submit(&ar, submitted % ASYNC_DEPTH, buf + ((size_t)next << SECTOR_SHIFT(vol)), snum + next, n) != 0) {
+                result = 1;
+                next = count;
+                break;
+            }
+            next += n;
+            submitted++;
+        }
+        if (collected < submitted) {
+            result |= async_wait(&ar, collected % ASYNC_DEPTH);
+            collected++;
+        }
+    }
+    async_destroy(&ar);
+    return result;
+}
+
+// Image I/O. Without an overlay these are the plain system calls on the
+// image file; with one, reads take each block from the overlay when it
+// holds it and from the base image otherwise, and writes only go to the
+// overlay. Every write is whole sectors, so it always covers whole blocks.
+// Read the image as it stands before any overlay
+static ssize_t base_pread(struct fat_volume *vol, void *buf, size_t len, off_t offset) {
+    if (vol->packed != NULL) {
+        return packed_pread(vol, buf, len, offset);
+    }
+    return pread(vol->fd, buf, len, offset);
+}
+
+static ssize_t image_pread(struct fat_volume *vol, void *buf, size_t len, off_t offset) {
+    struct overlay *ov = vol->overlay;
+    if (ov == NULL) {
+        return base_pread(vol, buf, len, offset);
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        off_t pos = offset + done;
+        uint64_t block = pos >> OVERLAY_BLOCK_SHIFT;
+        uint64_t last = (offset + len - 1) >> OVERLAY_BLOCK_SHIFT;
+        int present = overlay_has(ov, block);
+        while (block < last && overlay_has(ov, block + 1) == present) {
+            block++;
+        }
+        size_t run = ((off_t)(block + 1) << OVERLAY_BLOCK_SHIFT) - pos;
+        if (run > len - done) run = len - done;
+        ssize_t n = present ? pread(ov->fd, (char *)buf + done, run, ov->data_offset + pos)
+                            : base_pread(vol, (char *)buf + done, run, pos);
+        if (n < 0) return done > 0 ? (ssize_t)done : -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+static ssize_t image_pwrite(struct fat_volume *vol, const void *buf, size_t len, off_t offset) {
+    struct overlay *ov = vol->overlay;
+    if (ov == NULL && vol->packed != NULL) {
+        errno = EROFS;
+        return -1;
+    }
+    if (vol->changes != NULL && changes_stamp(vol->changes, offset, len) != 0) {
+        return -1;
+    }
+    if (ov == NULL) {
+        return pwrite(vol->fd, buf, len, offset);
+    }
+    ssize_t n = pwrite(ov->fd, buf, len, ov->data_offset + offset);
+    if (n > 0) {
+        overlay_mark(ov, offset, n, TRUE);
+    }
+    return n;
+}
+
+static ssize_t image_pwritev(struct fat_volume *vol, const struct iovec *iov, int iovcnt, off_t offset) {
+    struct overlay *ov = vol->overlay;
+    if (ov == NULL && vol->packed != NULL) {
+        errno = EROFS;
+        return -1;
+    }
+    if (vol->changes != NULL) {
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+        if (changes_stamp(vol->changes, offset, len) != 0) {
+            return -1;
+        }
+    }
+    if (ov == NULL) {
+        return pwritev(vol->fd, iov, iovcnt, offset);
+    }
+    ssize_t n = pwritev(ov->fd, iov, iovcnt, ov->data_offset + offset);
+    if (n > 0) {
+        overlay_mark(ov, offset, n, TRUE);
+    }
+    return n;
+}
+
+// Make everything written so far durable, including the overlay's map
+static int image_fsync(struct fat_volume *vol) {
+    if (vol->overlay == NULL) {
+        return fsync(vol->fd);
+    }
+    if (overlay_write_map(vol->overlay) != 0) {
+        return -1;
+    }
+    return fsync(vol->overlay->fd);
+}
+
+// Deallocate a freed byte range. An overlay drops its copy instead; the
+// base image still holds older contents, which no longer matter.
+static int image_punch(struct fat_volume *vol, off_t offset, off_t len) {
+    struct overlay *ov = vol->overlay;
+    if (ov == NULL && vol->packed != NULL) {
+        errno = EROFS;
+        return -1;
+    }
+    if (vol->changes != NULL && changes_stamp(vol->changes, offset, len) != 0) {
+        return -1;
+    }
+    if (ov == NULL) {
+        return fallocate(vol->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+    }
+    if (fallocate(ov->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, ov->data_offset + offset, len) != 0) {
+        return -1;
+    }
+    overlay_mark(ov, offset, len, FALSE);
+    return 0;
+}
+
+// Size of the image as read through image_pread(), before any overlay
+static int image_length(struct fat_volume *vol, uint64_t *size) {
+    struct stat st;
+    if (vol->packed != NULL) {
+        *size = vol->packed->image_size;
+        return 0;
+    }
+    if (fstat(vol->fd, &st) != 0) {
+        perror("Failed to stat disk image");
+        return 1;
+    }
+    *size = st.st_size;
+    return 0;
+}
+
+static int overlay_has(const struct overlay *ov, uint64_t block) {
+    return block < ov->nblocks && (ov->map[block >> 3] & (1 << (block & 7)));
+}
+
+static void overlay_mark(struct overlay *ov, off_t offset, size_t len, int present) {
+    uint64_t first = offset >> OVERLAY_BLOCK_SHIFT;
+    uint64_t end = (offset + len + (1 << OVERLAY_BLOCK_SHIFT) - 1) >> OVERLAY_BLOCK_SHIFT;
+    if (end > ov->nblocks) end = ov->nblocks;
+    for (uint64_t b = first; b < end; b++) {
+        if (present) {
+            ov->map[b >> 3] |= 1 << (b & 7);
+        } else {
+            ov->map[b >> 3] &= ~(1 << (b & 7));
+        }
+        ov->map_dirty[(b >> 3) / OVERLAY_ALIGN] = TRUE;
+    }
+}
+
+static int overlay_write_map(struct overlay *ov) {
+    size_t chunks = (ov->map_bytes + OVERLAY_ALIGN - 1) / OVERLAY_ALIGN;
+    for (size_t c = 0; c < chunks; c++) {
+        if (!ov->map_dirty[c]) continue;
+        size_t len = ov->map_bytes - c * OVERLAY_ALIGN;
+        if (len > OVERLAY_ALIGN) len = OVERLAY_ALIGN;
+        ssize_t n = pwrite(ov->fd, ov->map + c * OVERLAY_ALIGN, len, ov->map_offset + c * OVERLAY_ALIGN);
+        if (n != (ssize_t)len) {
+            if (n >= 0) errno = EIO;
+            perror("Failed to write overlay map");
+            return 1;
+        }
+        ov->map_dirty[c] = FALSE;
+    }
+    return 0;
+}
+
+// Open the overlay at 'path' over the base image already open in 'vol',
+// creating it if it does not exist. A new overlay is just its header and
+// an empty map; the data area is a hole the size of the base image.
+static int overlay_open(struct fat_volume *vol, const char *base_path, const char *path) {
+    struct stat st;
+    uint64_t base_size;
+    if (image_length(vol, &base_size) != 0) {
+        return 1;
+    }
+    struct overlay *ov = calloc(1, sizeof(*ov));
+    if (ov == NULL) {
+        perror("Failed to allocate overlay");
+        return 1;
+    }
+    vol->overlay = ov;
+    ov->base_path = strdup(base_path);
+    ov->base_size = base_size;
+    ov->nblocks = ov->base_size >> OVERLAY_BLOCK_SHIFT;
+    ov->map_bytes = (ov->nblocks + 7) / 8;
+    ov->map_offset = OVERLAY_ALIGN;
+    ov->data_offset = (ov->map_offset + ov->map_bytes + OVERLAY_ALIGN - 1) & ~(uint64_t)(OVERLAY_ALIGN - 1);
+    ov->map = calloc(1, ov->map_bytes + 1);
+    ov->map_dirty = calloc(1, ov->map_bytes / OVERLAY_ALIGN + 1);
+    ov->fd = open(path, (vol->sync_each ? O_SYNC : 0) | O_RDWR | O_CREAT, 0644);
+    if (ov->base_path == NULL || ov->map == NULL || ov->map_dirty == NULL) {
+        perror("Failed to allocate overlay");
+        return 1;
+    }
+    if (ov->fd < 0 || fstat(ov->fd, &st) != 0) {
+        perror(path);
+        return 1;
+    }
+
+    struct overlay_header h;
+    if (st.st_size == 0) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, OVERLAY_MAGIC, sizeof(h.magic));
+        h.version = htole32(FORMAT_VERSION);
+        h.block_shift = htole32(OVERLAY_BLOCK_SHIFT);
+        h.base_size = htole64(ov->base_size);
+        h.map_offset = htole64(ov->map_offset);
+        h.data_offset = htole64(ov->data_offset);
+        if (pwrite(ov->fd, &h, sizeof(h), 0) != sizeof(h) ||
+            ftruncate(ov->fd, ov->data_offset + ov->base_size) != 0) {
+            perror("Failed to create overlay");
+            return 1;
+        }
+        return 0;
+    }
+
+    if (pread(ov->fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, OVERLAY_MAGIC, sizeof(h.magic)) != 0 ||
+        le32toh(h.version) != FORMAT_VERSION || le32toh(h.block_shift) != OVERLAY_BLOCK_SHIFT ||
+        le64toh(h.map_offset) != ov->map_offset || le64toh(h.data_offset) != ov->data_offset) {
+        fprintf(stderr, "%s is not a fatmod overlay\n", path);
+        return 1;
+    }
+    if (le64toh(h.base_size) != ov->base_size) {
+        fprintf(stderr, "%s was made for a %llu-byte base image, not this %llu-byte one\n", path,
+                (unsigned long long)le64toh(h.base_size), (unsigned long long)ov->base_size);
+        return 1;
+    }
+    if (pread(ov->fd, ov->map, ov->map_bytes, ov->map_offset) != (ssize_t)ov->map_bytes) {
+        perror("Failed to read overlay map");
+        return 1;
+    }
+    return 0;
+}
+
+static void overlay_close(struct overlay *ov) {
+    if (ov == NULL) return;
+    if (ov->fd >= 0) {
+        close(ov->fd);
+    }
+    free(ov->base_path);
+    free(ov->map);
+    free(ov->map_dirty);
+    free(ov);
+}
+
+// Merge the overlay into the base image and empty it. The base is made
+// durable before the overlay is cleared, so a crash in between leaves
+// both holding the same data. The base keeps its own change map, if it
+// has one; every merged block is stamped there before it is written.
+static int commit_overlay(struct fat_volume *vol) {
+    struct overlay *ov = vol->overlay;
+    if (ov == NULL) {
+        printf("No overlay to commit\n");
+        return 1;
+    }
+    if (vol->packed != NULL) {
+        printf("The base image is packed and cannot be committed to\n");
+        return 1;
+    }
+    if (flush_image(vol) != 0) {
+        return 1;
+    }
+    struct change_map *cm = changes_open(ov->base_path, ov->base_size, FALSE);
+    if (cm == NULL && errno != ENOENT) {
+        return 1;
+    }
+    if (cm != NULL) {
+        for (uint64_t b = 0; b < ov->nblocks; b++) {
+            if (overlay_has(ov, b)) {
+                changes_mark(cm, (off_t)b << OVERLAY_BLOCK_SHIFT, 1 << OVERLAY_BLOCK_SHIFT);
+            }
+        }
+        if (changes_sync(cm) != 0) {
+            changes_close(cm);
+            return 1;
+        }
+        changes_close(cm);
+    }
+    int base = open(ov->base_path, O_WRONLY);
+    if (base < 0) {
+        perror(ov->base_path);
+        return 1;
+    }
+    unsigned char *buf = malloc(EXTENT_IO_MAX);
+    if (buf == NULL) {
+        perror("Failed to allocate commit buffer");
+        close(base);
+        return 1;
+    }
+
+    int result = 0;
+    uint64_t blocks = 0;
+    for (uint64_t b = 0; b < ov->nblocks && result == 0; b++) {
+        if (!overlay_has(ov, b)) continue;
+        uint64_t run = 1;
+        while (b + run < ov->nblocks && overlay_has(ov, b + run) &&
+               (run + 1) << OVERLAY_BLOCK_SHIFT <= EXTENT_IO_MAX) {
+            run++;
+        }
+        size_t len = run << OVERLAY_BLOCK_SHIFT;
+        off_t offset = (off_t)b << OVERLAY_BLOCK_SHIFT;
+        if (pread(ov->fd, buf, len, ov->data_offset + offset) != (ssize_t)len ||
+            pwrite(base, buf, len, offset) != (ssize_t)len) {
+            perror("Failed to merge overlay");
+            result = 1;
+        }
+        blocks += run;
+        b += run - 1;
+    }
+    if (result == 0 && fsync(base) != 0) {
+        perror("Failed to sync disk image");
+        result = 1;
+    }
+    close(base);
+    free(buf);
+    if (result != 0) {
+        return 1;
+    }
+
+    // Empty the overlay: clear the map and free its data area
+    memset(ov->map, 0, ov->map_bytes);
+    memset(ov->map_dirty, TRUE, ov->map_bytes / OVERLAY_ALIGN + 1);
+    if (overlay_write_map(ov) != 0 || ftruncate(ov->fd, ov->data_offset) != 0 ||
+        ftruncate(ov->fd, ov->data_offset + ov->base_size) != 0 || fsync(ov->fd) != 0) {
+        perror("Failed to reset overlay");
+        return 1;
+    }
+    printf("Committed %llu bytes to %s\n", (unsigned long long)blocks << OVERLAY_BLOCK_SHIFT, ov->base_path);
+    return 0;
+}
+
+// Change tracking. Every write to a tracked image stamps the units it
+// touches with the current generation, so -export-delta can find what
+// changed since any earlier export without reading the whole image. A
+// stamp is durable before the write that needs it is issued, so a crash
+// can over-report changes but never lose one.
+// Returns NULL if the map does not exist and 'create' is not set, or on
+// error after reporting it.
+static struct change_map *changes_open(const char *image_path, uint64_t image_size, int create) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s", image_path, CHANGES_SUFFIX) >= (int)sizeof(path)) {
+        fprintf(stderr, "Path too long: %s\n", image_path);
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    int fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        if (errno != ENOENT || create) perror(path);
+        return NULL;
+    }
+
+    struct change_map *cm = calloc(1, sizeof(*cm));
+    struct stat st;
+    if (cm == NULL || fstat(fd, &st) != 0) {
+        perror(path);
+        free(cm);
+        close(fd);
+        return NULL;
+    }
+    cm->fd = fd;
+    cm->image_size = image_size;
+    cm->nunits = (image_size + (1 << CHANGES_UNIT_SHIFT) - 1) >> CHANGES_UNIT_SHIFT;
+    size_t stamp_bytes = cm->nunits * sizeof(uint32_t);
+    cm->stamps = calloc(1, stamp_bytes + 1);
+    cm->page_dirty = calloc(1, stamp_bytes / CHANGES_PAGE + 1);
+    if (cm->stamps == NULL || cm->page_dirty == NULL) {
+        perror("Failed to allocate change map");
+        changes_close(cm);
+        return NULL;
+    }
+
+    struct changes_header h;
+    if (st.st_size == 0) {
+        // A new map: nothing has changed yet, and writes start generation 1
+        cm->generation = 1;
+        cm->header_dirty = TRUE;
+        if (ftruncate(fd, CHANGES_PAGE + stamp_bytes) != 0 || changes_sync(cm) != 0) {
+            perror(path);
+            changes_close(cm);
+            return NULL;
+        }
+        return cm;
+    }
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, CHANGES_MAGIC, sizeof(h.magic)) != 0 ||
+        le32toh(h.version) != FORMAT_VERSION || le32toh(h.unit_shift) != CHANGES_UNIT_SHIFT ||
+        le64toh(h.image_size) != image_size ||
+        pread(fd, cm->stamps, stamp_bytes, CHANGES_PAGE) != (ssize_t)stamp_bytes) {
+        fprintf(stderr, "%s does not belong to this image\n", path);
+        changes_close(cm);
+        errno = EINVAL;
+        return NULL;
+    }
+    cm->generation = le32toh(h.generation);
+    return cm;
+}
+
+static void changes_close(struct change_map *cm) {
+    if (cm == NULL) return;
+    close(cm->fd);
+    free(cm->stamps);
+    free(cm->page_dirty);
+    free(cm);
+}
+
+// Stamp the units of [offset, offset + len) in memory. Returns whether any
+// stamp changed.
+static int changes_mark(struct change_map *cm, off_t offset, size_t len) {
+    if (len == 0) return FALSE;
+    uint64_t first = offset >> CHANGES_UNIT_SHIFT;
+    uint64_t last = (offset + len - 1) >> CHANGES_UNIT_SHIFT;
+    uint32_t stamp = htole32(cm->generation);
+    int changed = FALSE;
+    for (uint64_t u = first; u <= last && u < cm->nunits; u++) {
+        if (cm->stamps[u] != stamp) {
+            cm->stamps[u] = stamp;
+            cm->page_dirty[u * sizeof(uint32_t) / CHANGES_PAGE] = TRUE;
+            changed = TRUE;
+        }
+    }
+    return changed;
+}
+
+// Stamp a range about to be written and, if that took a new stamp, make
+// the map durable before the caller issues the write. Units already
+// stamped in this generation cost nothing.
+static int changes_stamp(struct change_map *cm, off_t offset, size_t len) {
+    return changes_mark(cm, offset, len) ? changes_sync(cm) : 0;
+}
+
+// Write back changed stamp pages and the header, and make them durable
+static int changes_sync(struct change_map *cm) {
+    size_t stamp_bytes = cm->nunits * sizeof(uint32_t);
+    int wrote = FALSE;
+    for (size_t page = 0; page * CHANGES_PAGE < stamp_bytes; page++) {
+        if (!cm->page_dirty[page]) continue;
+        size_t len = stamp_bytes - page * CHANGES_PAGE;
+        if (len > CHANGES_PAGE) len = CHANGES_PAGE;
+        if (pwrite(cm->fd, (unsigned char *)cm->stamps + page * CHANGES_PAGE, len,
+                   CHANGES_PAGE + page * CHANGES_PAGE) != (ssize_t)len) {
+            perror("Failed to write change map");
+            return 1;
+        }
+        cm->page_dirty[page] = FALSE;
+        wrote = TRUE;
+    }
+    if (cm->header_dirty) {
+        struct changes_header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, CHANGES_MAGIC, sizeof(h.magic));
+        h.version = htole32(FORMAT_VERSION);
+        h.unit_shift = htole32(CHANGES_UNIT_SHIFT);
+        h.image_size = htole64(cm->image_size);
+        h.generation = htole32(cm->generation);
+        if (pwrite(cm->fd, &h, sizeof(h), 0) != sizeof(h)) {
+            perror("Failed to write change map");
+            return 1;
+        }
+        cm->header_dirty = FALSE;
+        wrote = TRUE;
+    }
+    if (wrote && fsync(cm->fd) != 0) {
+        perror("Failed to sync change map");
+        return 1;
+    }
+    return 0;
+}
+
+// Write every unit changed after generation 'since' to 'outpath' ("-" for
+// stdout), then close the current generation so later writes are newer
+// than this export
+static int export_delta(struct fat_volume *vol, uint32_t since, const char *outpath) {
+    struct change_map *cm = vol->changes;
+    if (cm == NULL) {
+        printf("Changes are not tracked for this image; open it once with --track-changes\n");
+        return 1;
+    }
+    if (flush_image(vol) != 0) {
+        return 1;
+    }
+    FILE *out = strcmp(outpath, "-") == 0 ? stdout : fopen(outpath, "wb");
+    unsigned char *buf = malloc(EXTENT_IO_MAX);
+    if (out == NULL || buf == NULL) {
+        perror(out == NULL ? outpath : "Failed to allocate delta buffer");
+        if (out != NULL && out != stdout) fclose(out);
+        free(buf);
+        return 1;
+    }
+
+    uint32_t until = cm->generation;
+    struct delta_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DELTA_MAGIC, sizeof(h.magic));
+    h.version = htole32(FORMAT_VERSION);
+    h.image_size = htole64(cm->image_size);
+    h.since = htole32(since);
+    h.until = htole32(until);
+    int result = fwrite(&h, sizeof(h), 1, out) != 1;
+
+    // One record per run of changed units, capped at the I/O size
+    uint64_t total = 0;
+    uint64_t u = 0;
+    while (u < cm->nunits && result == 0) {
+        if (le32toh(cm->stamps[u]) <= since) {
+            u++;
+            continue;
+        }
+        uint64_t run = 1;
+        while (u + run < cm->nunits && le32toh(cm->stamps[u + run]) > since &&
+               (run + 1) << CHANGES_UNIT_SHIFT <= EXTENT_IO_MAX) {
+            run++;
+        }
+        off_t offset = (off_t)u << CHANGES_UNIT_SHIFT;
+        size_t len = run << CHANGES_UNIT_SHIFT;
+        if (offset + len > cm->image_size) len = cm->image_size - offset;
+        struct delta_record rec = { htole64(offset), htole32(len), 0 };
+        if (image_pread(vol, buf, len, offset) != (ssize_t)len) {
+            perror("Failed to read changed data");
+            result = 1;
+        } else if (fwrite(&rec, sizeof(rec), 1, out) != 1 || fwrite(buf, 1, len, out) != len) {
+            result = 1;
+        }
+        STAT_ADD(vol, bytes_read, len);
+        total += len;
+        u += run;
+    }
+    struct delta_record end = { 0, 0, 0 };
+    if (result == 0 && fwrite(&end, sizeof(end), 1, out) != 1) {
+        result = 1;
+    }
+    if (fflush(out) != 0 || (out != stdout && fclose(out) != 0)) {
+        result = 1;
+    }
+    free(buf);
+    if (result != 0) {
+        perror("Failed to write delta");
+        return 1;
+    }
+
+    cm->generation = until + 1;
+    cm->header_dirty = TRUE;
+    if (changes_sync(cm) != 0) {
+        return 1;
+    }
+    fprintf(out == stdout ? stderr : stdout,
+            "Exported %llu changed bytes from generations %u to %u; next time export since %u\n",
+            (unsigned long long)total, since + 1, until, until);
+    return 0;
+}
+
+// Whether the file open at 'fd' starts like a packed image
+static int image_is_packed(int fd) {
+    char magic[sizeof(PACKED_MAGIC) - 1];
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, PACKED_MAGIC, sizeof(magic)) == 0;
+}
+
+// Replay a delta onto 'image', which must not be open elsewhere. The
+// image's own change map, if it has one, records the replayed writes.
+int fat_apply_delta(const char *image, const char *deltapath) {
+    int fd = open(image, O_RDWR);
+    FILE *in = strcmp(deltapath, "-") == 0 ? stdin : fopen(deltapath, "rb");
+    unsigned char *buf = malloc(EXTENT_IO_MAX);
+    struct stat st;
+    if (fd < 0 || in == NULL || buf == NULL || fstat(fd, &st) != 0) {
+        perror(fd < 0 ? image : in == NULL ? deltapath : "Failed to prepare delta");
+        if (fd >= 0) close(fd);
+        if (in != NULL && in != stdin) fclose(in);
+        free(buf);
+        return 1;
+    }
+
+    int result = 0;
+    struct delta_header h;
+    struct change_map *cm = NULL;
+    if (fread(&h, sizeof(h), 1, in) != 1 || memcmp(h.magic, DELTA_MAGIC, sizeof(h.magic)) != 0 ||
+        le32toh(h.version) != FORMAT_VERSION) {
+        fprintf(stderr, "%s is not a fatmod delta\n", deltapath);
+        result = 1;
+    } else if (image_is_packed(fd)) {
+        fprintf(stderr, "%s: %s; unpack it before applying a delta\n", image, strerror(EROFS));
+        result = 1;
+    } else if (le64toh(h.image_size) != (uint64_t)st.st_size) {
+        fprintf(stderr, "%s was made from a %llu-byte image, not this %llu-byte one\n", deltapath,
+                (unsigned long long)le64toh(h.image_size), (unsigned long long)st.st_size);
+        result = 1;
+    } else {
+        cm = changes_open(image, st.st_size, FALSE);
+    }
+
+    uint64_t total = 0;
+    while (result == 0) {
+        struct delta_record rec;
+        if (fread(&rec, sizeof(rec), 1, in) != 1) {
+            fprintf(stderr, "%s is truncated\n", deltapath);
+            result = 1;
+            break;
+        }
+        uint64_t offset = le64toh(rec.offset);
+        uint32_t len = le32toh(rec.length);
+        if (len == 0) break;
+        if (len > EXTENT_IO_MAX || offset + len > (uint64_t)st.st_size) {
+            fprintf(stderr, "%s: record at %llu lies outside the image\n", deltapath, (unsigned long long)offset);
+            result = 1;
+        } else if (fread(buf, 1, len, in) != len) {
+            fprintf(stderr, "%s is truncated\n", deltapath);
+            result = 1;
+        } else if (cm != NULL && changes_stamp(cm, offset, len) != 0) {
+            result = 1;
+        } else if (pwrite(fd, buf, len, offset) != (ssize_t)len) {
+            perror("Failed to write image");
+            result = 1;
+        } else {
+            total += len;
+        }
+    }
+
+    if (cm != NULL && changes_sync(cm) != 0) {
+        result = 1;
+    }
+    if (fsync(fd) != 0) {
+        perror("Failed to sync disk image");
+        result = 1;
+    }
+    if (result == 0) {
+        printf("Applied %llu bytes of changes from generations %u to %u\n", (unsigned long long)total,
+               le32toh(h.since) + 1, le32toh(h.until));
+    }
+    changes_close(cm);
+    close(fd);
+    if (in != stdin) fclose(in);
+    free(buf);
+    return result;
+}
+
+// Packed images. -pack stores the image as independently deflated 64 KiB
+// chunks behind an offset index, so it can be opened in place: a read
+// inflates only the chunks it covers, keeping the most recent few, and
+// all-zero chunks take no space at all. Returns 1 with nothing attached
+// if the image is not packed, -1 after reporting a damaged one.
+static int packed_open(struct fat_volume *vol) {
+    struct packed_header h;
+    struct stat st;
+    if (pread(vol->fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, PACKED_MAGIC, sizeof(h.magic)) != 0) {
+        return 1;
+    }
+    if (fstat(vol->fd, &st) != 0) {
+        perror("Failed to stat disk image");
+        return -1;
+    }
+    uint64_t image_size = le64toh(h.image_size);
+    uint64_t nchunks = le64toh(h.nchunks);
+    if (le32toh(h.version) != FORMAT_VERSION || le32toh(h.chunk_shift) != PACKED_CHUNK_SHIFT ||
+        nchunks != (image_size + (1 << PACKED_CHUNK_SHIFT) - 1) >> PACKED_CHUNK_SHIFT ||
+        (nchunks + 1) * sizeof(uint64_t) > (uint64_t)st.st_size) {
+        printf("Unsupported or damaged packed image\n");
+        return -1;
+    }
+
+    struct packed_image *pk = calloc(1, sizeof(*pk));
+    if (pk == NULL) {
+        perror("Failed to allocate packed image");
+        return -1;
+    }
+    vol->packed = pk;
+    pthread_mutex_init(&pk->lock, NULL);
+    pk->image_size = image_size;
+    pk->nchunks = nchunks;
+    pk->index = malloc((nchunks + 1) * sizeof(uint64_t));
+    pk->inbuf = malloc(1 << PACKED_CHUNK_SHIFT);
+    if (pk->index == NULL || pk->inbuf == NULL) {
+        perror("Failed to allocate packed image");
+        return -1;
+    }
+    size_t index_bytes = (nchunks + 1) * sizeof(uint64_t);
+    if (pread(vol->fd, pk->index, index_bytes, sizeof(h)) != (ssize_t)index_bytes) {
+        printf("Unsupported or damaged packed image\n");
+        return -1;
+    }
+    // Catch a bad index here rather than on some later read
+    for (uint64_t i = 0; i <= nchunks; i++) {
+        pk->index[i] = le64toh(pk->index[i]);
+        if ((i == 0 && pk->index[0] != sizeof(h) + index_bytes) ||
+            (i > 0 && (pk->index[i] < pk->index[i - 1] ||
+                       pk->index[i] - pk->index[i - 1] > (1 << PACKED_CHUNK_SHIFT))) ||
+            pk->index[i] > (uint64_t)st.st_size) {
+            printf("Unsupported or damaged packed image\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void packed_close(struct packed_image *pk) {
+    if (pk == NULL) return;
+    for (int i = 0; i < PACKED_CACHE_CHUNKS; i++) {
+        free(pk->cache[i].data);
+    }
+    pthread_mutex_destroy(&pk->lock);
+    free(pk->index);
+    free(pk->inbuf);
+    free(pk);
+}
+
+// Bring chunk 'c' into the cache, evicting the least recently used one.
+// Called with the packed image's lock held; NULL on error.
+static unsigned char *packed_chunk(struct fat_volume *vol, uint64_t c) {
+    struct packed_image *pk = vol->packed;
+    struct packed_chunk *slot = &pk->cache[0];
+    for (int i = 0; i < PACKED_CACHE_CHUNKS; i++) {
+        struct packed_chunk *pc = &pk->cache[i];
+        if (pc->used != 0 && pc->chunk == c) {
+            pc->used = ++pk->tick;
+            STAT_ADD(vol, chunk_hits, 1);
+            return pc->data;
+        }
+        if (pc->used < slot->used) {
+            slot = pc;
+        }
+    }
+
+    if (slot->data == NULL && (slot->data = malloc(1 << PACKED_CHUNK_SHIFT)) == NULL) {
+        return NULL;
+    }
+    slot->used = 0;
+    size_t stored = pk->index[c + 1] - pk->index[c];
+    uLongf len = 1 << PACKED_CHUNK_SHIFT;
+    uint64_t want = pk->image_size - (c << PACKED_CHUNK_SHIFT);
+    if (want > len) want = len;
+    if (stored == want) {
+        // Did not compress; kept verbatim
+        if (pread(vol->fd, slot->data, stored, pk->index[c]) != (ssize_t)stored) {
+            return NULL;
+        }
+    } else if (pread(vol->fd, pk->inbuf, stored, pk->index[c]) != (ssize_t)stored ||
+               uncompress(slot->data, &len, pk->inbuf, stored) != Z_OK || len != want) {
+        errno = EIO;
+        return NULL;
+    }
+    STAT_ADD(vol, chunks_inflated, 1);
+    slot->chunk = c;
+    slot->used = ++pk->tick;
+    return slot->data;
+}
+
+static ssize_t packed_pread(struct fat_volume *vol, void *buf, size_t len, off_t offset) {
+    struct packed_image *pk = vol->packed;
+    if ((uint64_t)offset >= pk->image_size) return 0;
+    if (offset + len > pk->image_size) len = pk->image_size - offset;
+
+    size_t done = 0;
+    pthread_mutex_lock(&pk->lock);
+    while (done < len) {
+        off_t pos = offset + done;
+        uint64_t c = pos >> PACKED_CHUNK_SHIFT;
+        size_t skip = pos & ((1 << PACKED_CHUNK_SHIFT) - 1);
+        size_t run = (1 << PACKED_CHUNK_SHIFT) - skip;
+        if (run > len - done) run = len - done;
+        if (pk->index[c + 1] == pk->index[c]) {
+            memset((char *)buf + done, 0, run);
+        } else {
+            unsigned char *data = packed_chunk(vol, c);
+            if (data == NULL) {
+                pthread_mutex_unlock(&pk->lock);
+                return done > 0 ? (ssize_t)done : -1;
+            }
+            memcpy((char *)buf + done, data + skip, run);
+        }
+        done += run;
+    }
+    pthread_mutex_unlock(&pk->lock);
+    return done;
+}
+
+// Write the image, as it reads now, to 'outpath' as a packed image
+static int pack_image(struct fat_volume *vol, const char *outpath) {
+    if (flush_image(vol) != 0) {
+        return 1;
+    }
+    uint64_t image_size;
+    if (image_length(vol, &image_size) != 0) {
+        return 1;
+    }
+    uint64_t nchunks = (image_size + (1 << PACKED_CHUNK_SHIFT) - 1) >> PACKED_CHUNK_SHIFT;
+    size_t index_bytes = (nchunks + 1) * sizeof(uint64_t);
+    uLong bound = compressBound(1 << PACKED_CHUNK_SHIFT);
+    uint64_t *index = malloc(index_bytes);
+    unsigned char *in = malloc(1 << PACKED_CHUNK_SHIFT);
+    unsigned char *out = malloc(bound);
+    int fd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (index == NULL || in == NULL || out == NULL || fd < 0) {
+        perror(fd < 0 ? outpath : "Failed to allocate pack buffers");
+        if (fd >= 0) close(fd);
+        free(index);
+        free(in);
+        free(out);
+        return 1;
+    }
+
+    int result = 0;
+    uint64_t pos = sizeof(struct packed_header) + index_bytes;
+    uint64_t zero_chunks = 0;
+    for (uint64_t c = 0; c < nchunks && result == 0; c++) {
+        index[c] = htole64(pos);
+        size_t len = image_size - (c << PACKED_CHUNK_SHIFT);
+        if (len > (1 << PACKED_CHUNK_SHIFT)) len = 1 << PACKED_CHUNK_SHIFT;
+        if (image_pread(vol, in, len, (off_t)c << PACKED_CHUNK_SHIFT) != (ssize_t)len) {
+            perror("Failed to read disk image");
+            result = 1;
+            break;
+        }
+        STAT_ADD(vol, bytes_read, len);
+        size_t i = 0;
+        while (i < len && in[i] == 0) i++;
+        if (i == len) {
+            zero_chunks++;
+            continue;
+        }
+        uLongf packed = bound;
+        const unsigned char *data = out;
+        if (compress2(out, &packed, in, len, Z_DEFAULT_COMPRESSION) != Z_OK || packed >= len) {
+            data = in;
+            packed = len;
+        }
+        if (pwrite(fd, data, packed, pos) != (ssize_t)packed) {
+            perror(outpath);
+            result = 1;
+        }
+        pos += packed;
+    }
+    index[nchunks] = htole64(pos);
+
+    struct packed_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PACKED_MAGIC, sizeof(h.magic));
+    h.version = htole32(FORMAT_VERSION);
+    h.chunk_shift = htole32(PACKED_CHUNK_SHIFT);
+    h.image_size = htole64(image_size);
+    h.nchunks = htole64(nchunks);
+    if (result == 0 && (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+                        pwrite(fd, index, index_bytes, sizeof(h)) != (ssize_t)index_bytes || fsync(fd) != 0)) {
+        perror(outpath);
+        result = 1;
+    }
+    close(fd);
+    free(index);
+    free(in);
+    free(out);
+    if (result == 0) {
+        printf("Packed %llu bytes into %llu (%llu of %llu chunks empty)\n", (unsigned long long)image_size,
+               (unsigned long long)pos, (unsigned long long)zero_chunks, (unsigned long long)nchunks);
+    }
+    return result;
+}
+
+static int map_image(struct fat_volume *vol) {
+    struct stat st;
+    if (fstat(vol->fd, &st) != 0) {
+        perror("Failed to stat disk image");
+        return 1;
+    }
+    vol->image_size = st.st_size;
+    vol->image_map = mmap(NULL, vol->image_size, PROT_READ | PROT_WRITE, MAP_SHARED, vol->fd, 0);
+    if (vol->image_map == MAP_FAILED) {
+        vol->image_map = NULL;
+        perror("Failed to map disk image");
+        return 1;
+    }
+    madvise(vol->image_map, vol->image_size, MADV_WILLNEED);
+    return 0;
+}
+
+static int compare_cached_sectors(const void *a, const void *b) {
+    uint32_t x = (*(struct cached_sector * const *)a)->snum;
+    uint32_t y = (*(struct cached_sector * const *)b)->snum;
+    return (x > y) - (x < y);
+}
+
+// Write every dirty sector out in sector order, one pwritev per run of
+// consecutive sectors. Does not fsync; see flush_image().
+static int flush_cache(struct fat_volume *vol) {
+    if (vol->cache_dirty_count == 0) return 0;
+
+    STAT_TIMER(vol, t);
+    struct cached_sector **list = malloc(vol->cache_dirty_count * sizeof(*list));
+    struct iovec *iov = malloc(FLUSH_IOVECS * sizeof(*iov));
+    if (list == NULL || iov == NULL) {
+        perror("Failed to allocate cache flush buffers");
+        free(list);
+        free(iov);
+        return 1;
+    }
+
+    uint32_t count = 0;
+    for (int b = 0; b < CACHE_BUCKETS; b++) {
+        for (struct cached_sector *cs = vol->sector_cache[b]; cs != NULL; cs = cs->next) {
+            list[count++] = cs;
+        }
+        vol->sector_cache[b] = NULL;
+    }
+    qsort(list, count, sizeof(*list), compare_cached_sectors);
+
+    int result = 0;
+    uint32_t i = 0;
+    while (i < count) {
+        int iovcnt = 0;
+        uint32_t first = list[i]->snum;
+        while (i + iovcnt < count && iovcnt < FLUSH_IOVECS &&
+               list[i + iovcnt]->snum == first + iovcnt) {
+            iov[iovcnt].iov_base = list[i + iovcnt]->data;
+            iov[iovcnt].iov_len = SECTOR_BYTES(vol);
+            iovcnt++;
+        }
+        ssize_t expected = (ssize_t)iovcnt * SECTOR_BYTES(vol);
+        if (image_pwritev(vol, iov, iovcnt, (off_t)first << SECTOR_SHIFT(vol)) != expected) {
+            perror("Failed to write cached sectors");
+            result = 1;
+        }
+        STAT_ADD(vol, sector_writes, iovcnt);
+        STAT_ADD(vol, bytes_written, expected);
+        i += iovcnt;
+    }
+
+    for (i = 0; i < count; i++) {
+        free(list[i]);
+    }
+    free(list);
+    free(iov);
+    vol->cache_dirty_count = 0;
+    STAT_LATENCY(vol, OP_CACHE_FLUSH, t);
+    return result;
+}
+
+// Mark the change map for every sector flush_image() is about to write:
+// dirty FAT sectors in each copy, the FSInfo sector and the cached sectors
+static void stamp_pending(struct fat_volume *vol) {
+    struct change_map *cm = vol->changes;
+    for (uint32_t s = 0; s < vol->sectors_per_fat; s++) {
+        if (!vol->fat_dirty[s]) continue;
+        for (int copy = 0; copy < vol->num_fats; copy++) {
+            changes_mark(cm, (off_t)(vol->reserved_sector_count + copy * vol->sectors_per_fat + s) << SECTOR_SHIFT(vol),
+                         SECTOR_BYTES(vol));
+        }
+    }
+    if (vol->fsinfo_valid && vol->fsinfo_dirty) {
+        changes_mark(cm, (off_t)vol->fsinfo_sector << SECTOR_SHIFT(vol), SECTOR_BYTES(vol));
+    }
+    for (int b = 0; b < CACHE_BUCKETS; b++) {
+        for (struct cached_sector *cs = vol->sector_cache[b]; cs != NULL; cs = cs->next) {
+            changes_mark(cm, (off_t)cs->snum << SECTOR_SHIFT(vol), SECTOR_BYTES(vol));
+        }
+    }
+}
+
+// Commit everything the command changed: FAT, FSInfo and cached sectors,
+// followed by a single durability barrier. Nothing to commit, no barrier.
+static int flush_image(struct fat_volume *vol) {
+    // Stamps first: the change map is durable before anything below is
+    // written, so a change can never reach the image without its stamp
+    if (vol->changes != NULL) {
+        stamp_pending(vol);
+        if (changes_sync(vol->changes) != 0) {
+            return 1;
+        }
+    }
+    int result = 0;
+    result |= flush_fat(vol);
+    result |= flush_fsinfo(vol);
+    result |= flush_cache(vol);
+    if (vol->needs_sync) {
+        vol->needs_sync = FALSE;
+        STAT_TIMER(vol, t);
+        if (vol->image_map != NULL) {
+            if (msync(vol->image_map, vol->image_size, MS_SYNC) != 0) {
+                perror("Failed to sync disk image");
+                result = 1;
+            }
+        } else if (image_fsync(vol) != 0) {
+            perror("Failed to sync disk image");
+            result = 1;
+        }
+        STAT_LATENCY(vol, OP_FSYNC, t);
+        STAT_ADD(vol, fsyncs, 1);
+    }
+    // Only after the barrier, so a crash cannot leave the old FAT pointing at holes
+    // The holes are stamped by image_punch(), since a delta must carry their zeros
+    if (result == 0) {
+        result |= punch_freed(vol);
+    }
+    return result;
+}
+
+static inline unsigned int cluster_to_sector(struct fat_volume *vol, uint32_t cnum) {
+    return vol->root_cluster_start_sector + ((cnum - 2) << SPC_SHIFT(vol));
+}
+
+static int writecluster(struct fat_volume *vol, unsigned char *buf, unsigned int cnum) {
+    return writeextent(vol, buf, cnum, 1);
+}
+
+// Read 'count' physically contiguous clusters with a single request
+static int readextent(struct fat_volume *vol, unsigned char *buf, uint32_t start, uint32_t count) {
+    if (start < 2 || start + count > vol->cluster_count) return 1;
+    return readsectors(vol, buf, cluster_to_sector(vol, start), count << SPC_SHIFT(vol));
+}
+
+// Write 'count' physically contiguous clusters with a single request
+static int writeextent(struct fat_volume *vol, unsigned char *buf, uint32_t start, uint32_t count) {
+    if (start < 2 || start + count > vol->cluster_count) return 1;
+    return writesectors(vol, buf, cluster_to_sector(vol, start), count << SPC_SHIFT(vol));
+}
+
+// Collapse the chain starting at 'start_cluster' into runs of contiguous
+// clusters. Returns the number of extents (the array is malloc'ed and
+// owned by the caller), or -1 on error or if the chain loops.
+static int get_chain_extents(struct fat_volume *vol, uint32_t start_cluster, struct extent **extents) {
+    int capacity = 16, n = 0;
+    struct extent *list = malloc(capacity * sizeof(*list));
+    if (list == NULL) return -1;
+
+    uint32_t steps = 0;
+    uint32_t cluster_num = start_cluster;
+    while (cluster_num >= 2 && cluster_num < FAT_EOC) {
+        if (cluster_num >= vol->cluster_count || ++steps > vol->cluster_count) {
+            free(list);
+            return -1;
+        }
+        if (n > 0 && list[n - 1].start + list[n - 1].count == cluster_num) {
+            list[n - 1].count++;
+        } else {
+            if (n == capacity) {
+                capacity *= 2;
+                struct extent *grown = realloc(list, capacity * sizeof(*list));
+                if (grown == NULL) {
+                    free(list);
+                    return -1;
+                }
+                list = grown;
+            }
+            list[n].start = cluster_num;
+            list[n].count = 1;
+            n++;
+        }
+        cluster_num = get_next_cluster(vol, cluster_num);
+    }
+
+    *extents = list;
+    return n;
+}
+
+// Index the chain starting at 'start_cluster' into 'ci'. Returns 0, or 1
+// if the chain is corrupt or memory runs out.
+static int build_chain_index(struct fat_volume *vol, uint32_t start_cluster, struct chain_index *ci) {
+    memset(ci, 0, sizeof(*ci));
+    ci->count = get_chain_extents(vol, start_cluster, &ci->extents);
+    if (ci->count < 0) {
+        ci->extents = NULL;
+        return 1;
+    }
+    ci->first = malloc((ci->count + 1) * sizeof(uint32_t));
+    if (ci->first == NULL) {
+        free_chain_index(ci);
+        return 1;
+    }
+    for (int e = 0; e < ci->count; e++) {
+        ci->first[e] = ci->nclusters;
+        ci->nclusters += ci->extents[e].count;
+    }
+    ci->first[ci->count] = ci->nclusters;
+    ci->start_cluster = start_cluster;
+    ci->generation = vol->fat_generation;
+    return 0;
+}
+
+static void free_chain_index(struct chain_index *ci) {
+    free(ci->extents);
+    free(ci->first);
+    memset(ci, 0, sizeof(*ci));
+}
+
+// Cached index of the chain starting at 'start_cluster', built on first
+// use and again after any FAT change. NULL if the chain is corrupt. The
+// caller holds the index until put_chain_index(); when every cached index
+// is held by another reader, a private one is built instead.
+static struct chain_index *get_chain_index(struct fat_volume *vol, uint32_t start_cluster) {
+    pthread_mutex_lock(&vol->chain_lock);
+    for (int i = 0; i < CHAIN_CACHE_SIZE; i++) {
+        struct chain_index *ci = &vol->chain_cache[i];
+        if (ci->generation == vol->fat_generation && ci->start_cluster == start_cluster) {
+            ci->users++;
+            pthread_mutex_unlock(&vol->chain_lock);
+            return ci;
+        }
+    }
+
+    struct chain_index *ci = NULL;
+    for (int i = 0; i < CHAIN_CACHE_SIZE && ci == NULL; i++) {
+        struct chain_index *slot = &vol->chain_cache[vol->chain_cache_next];
+        vol->chain_cache_next = (vol->chain_cache_next + 1) % CHAIN_CACHE_SIZE;
+        if (slot->users == 0) ci = slot;
+    }
+    if (ci != NULL) {
+        free_chain_index(ci);
+    } else if ((ci = malloc(sizeof(*ci))) == NULL) {
+        pthread_mutex_unlock(&vol->chain_lock);
+        return NULL;
+    }
+    if (build_chain_index(vol, start_cluster, ci) != 0) {
+        fprintf(stderr, "Corrupt cluster chain at cluster %u\n", start_cluster);
+        if (ci < vol->chain_cache || ci >= vol->chain_cache + CHAIN_CACHE_SIZE) free(ci);
+        pthread_mutex_unlock(&vol->chain_lock);
+        return NULL;
+    }
+    ci->users = 1;
+    pthread_mutex_unlock(&vol->chain_lock);
+    return ci;
+}
+
+static void put_chain_index(struct fat_volume *vol, struct chain_index *ci) {
+    if (ci == NULL) return;
+    pthread_mutex_lock(&vol->chain_lock);
+    if (ci >= vol->chain_cache && ci < vol->chain_cache + CHAIN_CACHE_SIZE) {
+        ci->users--;
+    } else {
+        free_chain_index(ci);
+        free(ci);
+    }
+    pthread_mutex_unlock(&vol->chain_lock);
+}
+
+// Extent holding file cluster 'file_cluster', or -1 past the end of the chain
+static int chain_index_find(const struct chain_index *ci, uint32_t file_cluster) {
+    if (file_cluster >= ci->nclusters) return -1;
+    int lo = 0, hi = ci->count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (ci->first[mid] <= file_cluster) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Walks the byte range [pos, end) of an indexed chain in pieces that
+// never cross an extent, each covering whole sectors of the image
+struct range_cursor {
+    const struct chain_index *ci;
+    int e;
+    uint32_t pos, end;
+};
+
+struct range_piece {
+    unsigned int snum;            // first image sector to read
+    unsigned int sectors;
+    uint32_t skip;                // bytes to skip in the first sector
+    uint32_t len;                 // bytes of file data
+    uint32_t pos;                 // file offset of the data
+};
+
+// Next piece of at most 'max_clusters' clusters; 0 once the range is done
+static int next_range_piece(struct fat_volume *vol, struct range_cursor *rc, uint32_t max_clusters, struct range_piece *piece) {
+    while (rc->e < rc->ci->count && rc->pos < rc->end) {
+        const struct extent *x = &rc->ci->extents[rc->e];
+        uint32_t skip = (rc->pos >> CLUSTER_SHIFT(vol)) - rc->ci->first[rc->e];
+        if (skip >= x->count) {
+            rc->e++;
+            continue;
+        }
+        uint32_t count = x->count - skip < max_clusters ? x->count - skip : max_clusters;
+        uint32_t intra = rc->pos & CLUSTER_MASK(vol);
+        uint64_t len = ((uint64_t)count << CLUSTER_SHIFT(vol)) - intra;
+        if (len > rc->end - rc->pos) len = rc->end - rc->pos;
+
+        piece->snum = cluster_to_sector(vol, x->start + skip) + (intra >> SECTOR_SHIFT(vol));
+        piece->skip = intra & SECTOR_MASK(vol);
+        piece->sectors = (piece->skip + len + SECTOR_MASK(vol)) >> SECTOR_SHIFT(vol);
+        piece->len = len;
+        piece->pos = rc->pos;
+        rc->pos += len;
+        return 1;
+    }
+    return 0;
+}
+
+// Feed bytes [offset, offset + len) of an indexed chain to 'fn' in file
+// order. 'fn' sees file offsets; the range must lie within the chain.
+// With the image mapped the data is passed in place; otherwise an async
+// reader keeps ASYNC_DEPTH reads in flight ahead of 'fn'.
+static int stream_range(struct fat_volume *vol, const struct chain_index *ci, uint32_t offset, uint32_t len,
+                 file_chunk_fn fn, void *arg) {
+    if (len == 0) return 0;
+    int e = chain_index_find(ci, offset >> CLUSTER_SHIFT(vol));
+    if (e < 0 || ((uint64_t)offset + len + CLUSTER_MASK(vol)) >> CLUSTER_SHIFT(vol) > ci->nclusters) {
+        fprintf(stderr, "Range %u+%u lies outside the cluster chain\n", offset, len);
+        return 1;
+    }
+    struct range_cursor rc = { ci, e, offset, offset + len };
+    struct range_piece piece;
+
+    if (vol->image_map != NULL) {
+        while (next_range_piece(vol, &rc, vol->extent_io_max >> CLUSTER_SHIFT(vol), &piece)) {
+            unsigned char *data = map_sectors(vol, NULL, piece.snum, piece.sectors);
+            if (data == NULL) {
+                perror("Failed to read file cluster");
+                return 1;
+            }
+            if (fn(data + piece.skip, piece.len, piece.pos, arg) != 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // Split the I/O budget across the queue so a single large extent is
+    // read by several requests at once
+    uint32_t max_clusters = (vol->extent_io_max / ASYNC_DEPTH) >> CLUSTER_SHIFT(vol);
+    if (max_clusters == 0) max_clusters = 1;
+    size_t slot_bytes = (size_t)max_clusters << CLUSTER_SHIFT(vol);
+    unsigned char *buffers = malloc(slot_bytes * ASYNC_DEPTH);
+    struct async_reader *ar = malloc(sizeof(*ar));
+    if (buffers == NULL || ar == NULL) {
+        free(buffers);
+        free(ar);
+        return 1;
+    }
+    async_init(ar, vol);
+
+    struct range_piece pieces[ASYNC_DEPTH];
+    int result = 0;
+    unsigned int submitted = 0, collected = 0;
+    int more = TRUE;
+    while (result == 0 && (more || collected < submitted)) {
+        while (more && submitted - collected < ASYNC_DEPTH) {
+            int i = submitted % ASYNC_DEPTH;
+            more = next_range_piece(vol, &rc, max_clusters, &pieces[i]);
+            if (!more) break;
+            if (async_submit(ar, i, buffers + slot_bytes * i, pieces[i].snum, pieces[i].sectors) != 0) {
+                perror("Failed to queue file read");
+                result = 1;
+                break;
+            }
+            submitted++;
+        }
+        if (result == 0 && collected < submitted) {
+            int i = collected % ASYNC_DEPTH;
+            if (async_wait(ar, i) != 0) {
+                perror("Failed to read file cluster");
+                result = 1;
+            } else if (fn(buffers + slot_bytes * i + pieces[i].skip, pieces[i].len, pieces[i].pos, arg) != 0) {
+                result = 1;
+            }
+            collected++;
+        }
+    }
+
+    async_destroy(ar);
+    free(ar);
+    free(buffers);
+    return result;
+}
+
+// Feed the first 'file_size' bytes of a cluster chain to 'fn'. Uses a
+// private index so extraction threads can call it concurrently.
+static int stream_file(struct fat_volume *vol, uint32_t start_cluster, uint32_t file_size, file_chunk_fn fn, void *arg) {
+    struct chain_index ci;
+    if (build_chain_index(vol, start_cluster, &ci) != 0) {
+        fprintf(stderr, "Corrupt cluster chain at cluster %u\n", start_cluster);
+        return 1;
+    }
+    if (((uint64_t)file_size + CLUSTER_MASK(vol)) >> CLUSTER_SHIFT(vol) > ci.nclusters) {
+        file_size = ci.nclusters << CLUSTER_SHIFT(vol);
+    }
+    int result = stream_range(vol, &ci, 0, file_size, fn, arg);
+    free_chain_index(&ci);
+    return result;
+}
+
+// The index of the directory at 'path' (the root for NULL or "/"), or
+// NULL with errno set
+static struct dir_index *open_directory(struct fat_volume *vol, const char *path) {
+    uint32_t start = vol->root_cluster;
+    if (path != NULL && strcmp(path, "/") != 0) {
+        struct msdos_dir_entry *dir_entry = find_file_entry(vol, path, NULL);
+        if (dir_entry == NULL || !(dir_entry->attr & ATTR_DIR)) {
+            errno = dir_entry == NULL ? ENOENT : ENOTDIR;
+            return NULL;
+        }
+        start = le16toh(dir_entry->start) | (le16toh(dir_entry->starthi) << 16);
+    }
+    return load_dir(vol, start);
+}
+
+static int list_directory(struct fat_volume *vol, const char *path) {
+    struct dir_index *dir = open_directory(vol, path);
+    if (dir == NULL) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            printf("Directory not found: %s\n", path);
+        } else {
+            perror(path != NULL ? path : "/");
+        }
+        return 1;
+    }
+    struct msdos_dir_entry *dep = (struct msdos_dir_entry *)dir->data;
+
+    // Iterate through directory entries
+    for (uint32_t i = 0; i < dir->end; ++i, ++dep) {
+        if (!entry_is_indexed(dep)) {
+            continue;
+        }
+        char name[9];
+        char ext[4];
+        strncpy(name, (char *)dep->name, 8);
+        name[8] = '\0';
+        strncpy(ext, (char *)dep->name + 8, 3);
+        ext[3] = '\0';
+
+        printf("%s.%s %d\n", name, ext, dep->size);
+    }
+    return 0;
+}
+
+// Output stage of the -r -b dump: bytes are formatted into one large
+// buffer and handed to stdio in big chunks instead of one printf per byte.
+// "xx " for every byte value, padded to four bytes so each copy is one store
+static char hex_table[256][4];
+static pthread_once_t hex_table_once = PTHREAD_ONCE_INIT;
+
+static void out_flush(struct hex_output *out) {
+    if (out->len > 0) {
+        fwrite(out->buf, 1, out->len, stdout);
+        out->len = 0;
+    }
+}
+
+static void init_hex_table(void) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 256; i++) {
+        hex_table[i][0] = digits[i >> 4];
+        hex_table[i][1] = digits[i & 15];
+        hex_table[i][2] = ' ';
+        hex_table[i][3] = '\0';
+    }
+}
+
+// Append "\n%08x: " for a line starting at 'offset'
+static inline unsigned char *put_line_header(unsigned char *p, uint32_t offset) {
+    *p++ = '\n';
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        memcpy(p, hex_table[(offset >> shift) & 0xFF], 2);
+        p += 2;
+    }
+    *p++ = ':';
+    *p++ = ' ';
+    return p;
+}
+
+static int print_ascii_chunk(const unsigned char *data, size_t len, uint32_t offset, void *arg) {
+    fwrite(data, 1, len, stdout);
+    return 0;
+}
+
+static int print_binary_chunk(const unsigned char *data, size_t len, uint32_t offset, void *arg) {
+    struct hex_output *out = arg;
+    size_t i = 0;
+    while (i < len) {
+        if (OUTBUF_SIZE - out->len < HEX_LINE_MAX) {
+            out_flush(out);
+        }
+        unsigned char *p = out->buf + out->len;
+
+        if (offset % 16 == 0 && len - i >= 16) {
+            // Whole line: header plus sixteen table lookups
+            p = put_line_header(p, offset);
+            for (int j = 0; j < 16; j++) {
+                memcpy(p, hex_table[data[i + j]], 4);
+                p += 3;
+            }
+            i += 16;
+            offset += 16;
+        } else {
+            if (offset % 16 == 0) {
+                p = put_line_header(p, offset);
+            }
+            memcpy(p, hex_table[data[i]], 4);
+            p += 3;
+            i++;
+            offset++;
+        }
+        out->len = p - out->buf;
+    }
+    return 0;
+}
+
+// Look 'filename' up and clamp the range [offset, offset + len) to its
+// size. Returns the index of its chain, held for the caller, or NULL after
+// reporting to 'err' why nothing can be read.
+static struct chain_index *open_range(struct fat_volume *vol, const char *filename, uint32_t *offset, uint32_t *len,
+                                      FILE *err) {
+    struct msdos_dir_entry *file_entry = find_file_entry(vol, filename, NULL);
+    if (file_entry == NULL) {
+        fprintf(err, "File not found: %s\n", filename);
+        return NULL;
+    }
+
+    uint32_t cluster_num = le16toh(file_entry->start) | (le16toh(file_entry->starthi) << 16);
+    uint32_t file_size = le32toh(file_entry->size);
+    if (*offset > file_size) {
+        fprintf(err, "Offset exceeds file size. File size: %u bytes\n", file_size);
+        return NULL;
+    }
+    if ((uint64_t)*offset + *len > file_size) {
+        *len = file_size - *offset;
+    }
+
+    struct chain_index *ci = get_chain_index(vol, cluster_num);
+    if (ci != NULL && ((uint64_t)*offset + *len + CLUSTER_MASK(vol)) >> CLUSTER_SHIFT(vol) > ci->nclusters) {
+        // A chain shorter than the size: show what the chain holds
+        uint64_t chain_bytes = (uint64_t)ci->nclusters << CLUSTER_SHIFT(vol);
+        *len = *offset < chain_bytes ? chain_bytes - *offset : 0;
+    }
+    return ci;
+}
+
+static int display_file_ascii(struct fat_volume *vol, const char *filename, uint32_t offset, uint32_t len) {
+    struct chain_index *ci = open_range(vol, filename, &offset, &len, stdout);
+    if (ci == NULL) {
+        return 1;
+    }
+
+    int result = stream_range(vol, ci, offset, len, print_ascii_chunk, NULL);
+    put_chain_index(vol, ci);
+    printf("\n");
+    return result;
+}
+
+static int display_file_binary(struct fat_volume *vol, const char *filename, uint32_t offset, uint32_t len) {
+    struct chain_index *ci = open_range(vol, filename, &offset, &len, stdout);
+    if (ci == NULL) {
+        return 1;
+    }
+    struct hex_output *out = malloc(sizeof(*out));
+    if (out == NULL) {
+        perror("Failed to allocate output buffer");
+        put_chain_index(vol, ci);
+        return 1;
+    }
+    out->len = 0;
+
+    // Display the content in binary (hexadecimal) form
+    pthread_once(&hex_table_once, init_hex_table);
+    if (offset % 16 != 0 && len > 0) {
+        // A range starting mid-line gets its own line header
+        out->len = put_line_header(out->buf, offset) - out->buf;
+    }
+    int result = stream_range(vol, ci, offset, len, print_binary_chunk, out);
+    put_chain_index(vol, ci);
+    out_flush(out);
+    free(out);
+    printf("\n");
+    return result;
+}
+
+// Copy the file's bytes to stdout unformatted. Contiguous runs go straight
+// from the image to stdout with sendfile() when nothing newer is cached.
+static int display_file_raw(struct fat_volume *vol, const char *filename, uint32_t offset, uint32_t len) {
+    struct chain_index *ci = open_range(vol, filename, &offset, &len, stderr);
+    if (ci == NULL) {
+        return 1;
+    }
+
+    int result = 0;
+    if (vol->image_map != NULL || vol->cache_dirty_count > 0 || vol->overlay != NULL || vol->packed != NULL) {
+        result = stream_range(vol, ci, offset, len, print_ascii_chunk, NULL);
+        fflush(stdout);
+        put_chain_index(vol, ci);
+        return result;
+    }
+
+    fflush(stdout);
+    uint32_t pos = offset, end = offset + len;
+    for (int e = len > 0 ? chain_index_find(ci, offset >> CLUSTER_SHIFT(vol)) : ci->count;
+         e >= 0 && e < ci->count && pos < end && result == 0; e++) {
+        uint32_t skip_bytes = pos - (ci->first[e] << CLUSTER_SHIFT(vol));
+        off_t disk_pos = ((off_t)cluster_to_sector(vol, ci->extents[e].start) << SECTOR_SHIFT(vol)) + skip_bytes;
+        size_t chunk = ((size_t)ci->extents[e].count << CLUSTER_SHIFT(vol)) - skip_bytes;
+        if (chunk > end - pos) chunk = end - pos;
+        while (chunk > 0) {
+            ssize_t sent = sendfile(STDOUT_FILENO, vol->fd, &disk_pos, chunk);
+            if (sent <= 0) {
+                if (sent < 0 && (errno == EINVAL || errno == ENOSYS) && pos == offset) {
+                    // stdout cannot take sendfile(); fall back to buffered copies
+                    result = stream_range(vol, ci, offset, len, print_ascii_chunk, NULL);
+                    fflush(stdout);
+                } else {
+                    perror("Failed to copy file data");
+                    result = 1;
+                }
+                break;
+            }
+            STAT_ADD(vol, sector_reads, (sent + SECTOR_MASK(vol)) >> SECTOR_SHIFT(vol));
+            STAT_ADD(vol, bytes_read, sent);
+            chunk -= sent;
+            pos += sent;
+        }
+    }
+    put_chain_index(vol, ci);
+    return result;
+}
+
+// Add an empty file named 'name' to 'dir' and write its entry. Returns
+// the entry, or NULL with errno set.
+static struct msdos_dir_entry *add_file_entry(struct fat_volume *vol, struct dir_index *dir,
+                                              const unsigned char name[11]) {
+    struct msdos_dir_entry *free_entry = dir_add_entry(vol, dir, name);
+    if (free_entry == NULL) {
+        return NULL;
+    }
+
+    // Create the new file entry
+    free_entry->attr = ATTR_ARCH; // Archive attribute
+    free_entry->start = 0; // No cluster allocated initially
+    free_entry->size = 0; // Initial size 0
+
+    // Write the updated directory sector back to disk
+    if (dir_write_entry(vol, dir, free_entry) != 0) {
+        return NULL;
+    }
+    return free_entry;
+}
+
+static int create_file(struct fat_volume *vol, const char *filename) {
+    unsigned char name[11];
+    struct dir_index *dir = resolve_parent(vol, filename, name);
+    if (dir == NULL) {
+        printf("%s: %s\n", resolve_error(errno), filename);
+        return 1;
+    }
+
+    if (dir_lookup(dir, name) != NULL) {
+        printf("File already exists: %s\n", filename);
+        return 1;
+    }
+    if (add_file_entry(vol, dir, name) == NULL) {
+        perror(filename);
+        return 1;
+    }
+
+    printf("File created: %s\n", filename);
+    return 0;
+}
+
+static int delete_file(struct fat_volume *vol, const char *filename) {
+
+    // Locate the file through the directory index
+    struct dir_index *dir;
+    struct msdos_dir_entry *file_entry = find_file_entry(vol, filename, &dir);
+    if (file_entry == NULL) {
+        printf("File not found: %s\n", filename);
+        return 1;
+    }
+    if (file_entry->attr & ATTR_DIR) {
+        printf("Is a directory: %s\n", filename);
+        return 1;
+    }
+
+    if (remove_file(vol, dir, file_entry) != 0) {
+        perror(filename);
+        return 1;
+    }
+    printf("File deleted: %s\n", filename);
+    return 0;
+}
+
+// Free a file's chain and remove its directory entry. Returns 0, or 1
+// with errno set.
+static int remove_file(struct fat_volume *vol, struct dir_index *dir, struct msdos_dir_entry *file_entry) {
+    // Deallocate all clusters used by the file
+    if (free_chain(vol, le16toh(file_entry->start) | (le16toh(file_entry->starthi) << 16)) != 0) {
+        return 1;
+    }
+
+    // Mark the directory entry as deleted
+    dir_remove_entry(dir, file_entry);
+
+    // Write the updated directory sector back to disk
+    if (dir_write_entry(vol, dir, file_entry) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+// Format a raw 8.3 name as "NAME.EXT" (or "NAME" without an extension)
+static void format_83_name(const unsigned char *raw, char out[13]) {
+    int len = 0;
+    for (int i = 0; i < 8 && raw[i] != ' '; i++) {
+        out[len++] = raw[i];
+    }
+    if (raw[8] != ' ') {
+        out[len++] = '.';
+        for (int i = 8; i < 11 && raw[i] != ' '; i++) {
+            out[len++] = raw[i];
+        }
+    }
+    out[len] = '\0';
+}
+
+// Create every missing parent directory of 'path' on the host
+static int make_host_dirs(char *path) {
+    for (char *p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int rc = mkdir(path, 0755);
+        *p = '/';
+        if (rc != 0 && errno != EEXIST) {
+            perror(path);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int add_extract_job(struct extract_list *list, const char *host_path,
+                           const struct msdos_dir_entry *entry) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        struct extract_job *grown = realloc(list->jobs, capacity * sizeof(*grown));
+        if (grown == NULL) return 1;
+        list->jobs = grown;
+        list->capacity = capacity;
+    }
+    struct extract_job *job = &list->jobs[list->count++];
+    job->start_cluster = le16toh(entry->start) | (le16toh(entry->starthi) << 16);
+    job->size = le32toh(entry->size);
+    job->host_path = strdup(host_path);
+    job->failed = FALSE;
+    return job->host_path == NULL;
+}
+
+// Visit every file and directory below 'start' (depth first, skipping "."
+// and ".."), building each entry's path under 'prefix'. A directory is
+// descended into only if its visit succeeds.
+static int walk_tree(struct fat_volume *vol, uint32_t start, const char *prefix, int depth, tree_visit_fn fn, void *arg) {
+    if (depth > TREE_DEPTH_MAX) {
+        fprintf(stderr, "Directory tree too deep below %s\n", prefix);
+        return 1;
+    }
+    struct dir_index *dir = load_dir(vol, start);
+    if (dir == NULL) {
+        fprintf(stderr, "%s: %s\n", prefix[0] ? prefix : "/", strerror(errno));
+        return 1;
+    }
+
+    int result = 0;
+    for (uint32_t i = 0; i < dir->end; i++) {
+        struct msdos_dir_entry *entry = (struct msdos_dir_entry *)dir->data + i;
+        if (!entry_is_indexed(entry) || entry->name[0] == '.') {
+            continue;
+        }
+        char name[13];
+        char path[PATH_MAX];
+        format_83_name(entry->name, name);
+        snprintf(path, sizeof(path), "%s/%s", prefix, name);
+
+        int visit = fn(vol, dir, entry, path, arg);
+        result |= visit;
+        if (visit == 0 && (entry->attr & ATTR_DIR)) {
+            result |= walk_tree(vol, le16toh(entry->start) | (le16toh(entry->starthi) << 16),
+                                path, depth + 1, fn, arg);
+        }
+    }
+    return result;
+}
+
+// Queue every regular file, recreating the directory tree on the host
+static int collect_extract_job(struct fat_volume *vol, struct dir_index *dir, struct msdos_dir_entry *entry,
+                               const char *path, void *arg) {
+    if (entry->attr & ATTR_DIR) {
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            perror(path);
+            return 1;
+        }
+        return 0;
+    }
+    return add_extract_job(arg, path, entry);
+}
+
+static int write_chunk_to_host(const unsigned char *data, size_t len, uint32_t offset, void *arg) {
+    int out = *(int *)arg;
+    while (len > 0) {
+        ssize_t n = write(out, data, len);
+        if (n <= 0) return 1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Worker: claim jobs until none are left. Only reads the FAT, the sector
+// cache and the image, all of which stay unchanged while workers run.
+static void *extract_worker(void *arg) {
+    struct extract_list *list = arg;
+    for (;;) {
+        int i = __atomic_fetch_add(&list->next, 1, __ATOMIC_RELAXED);
+        if (i >= list->count) break;
+
+        struct extract_job *job = &list->jobs[i];
+        int out = open(job->host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            perror(job->host_path);
+            job->failed = TRUE;
+            continue;
+        }
+        if (stream_file(list->vol, job->start_cluster, job->size, write_chunk_to_host, &out) != 0) {
+            fprintf(stderr, "Failed to extract %s\n", job->host_path);
+            job->failed = TRUE;
+        }
+        if (close(out) != 0) {
+            perror(job->host_path);
+            job->failed = TRUE;
+        }
+    }
+    return NULL;
+}
+
+// Copy FILES (or, with none given, every file in the image) into DESTDIR
+// using a pool of threads that read independent files in parallel.
+static int extract_files(struct fat_volume *vol, const char *destdir, int nfiles, char *files[]) {
+    struct extract_list list = { .vol = vol };
+    int result = 0;
+
+    if (mkdir(destdir, 0755) != 0 && errno != EEXIST) {
+        perror(destdir);
+        return 1;
+    }
+
+    // Directory walking uses the shared directory cache, so it stays serial
+    if (nfiles == 0) {
+        result |= walk_tree(vol, vol->root_cluster, destdir, 0, collect_extract_job, &list);
+    }
+    for (int i = 0; i < nfiles; i++) {
+        struct msdos_dir_entry *file_entry = find_file_entry(vol, files[i], NULL);
+        if (file_entry == NULL || (file_entry->attr & ATTR_DIR)) {
+            printf("File not found: %s\n", files[i]);
+            result = 1;
+            continue;
+        }
+        char path[PATH_MAX];
+        const char *name = files[i];
+        while (*name == '/') name++;
+        snprintf(path, sizeof(path), "%s/%s", destdir, name);
+        if (make_host_dirs(path) != 0 || add_extract_job(&list, path, file_entry) != 0) {
+            result = 1;
+        }
+    }
+
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    if (nthreads > EXTRACT_THREADS_MAX) nthreads = EXTRACT_THREADS_MAX;
+    if (nthreads > list.count) nthreads = list.count;
+    if (nthreads < 1) nthreads = 1;
+
+    pthread_t threads[EXTRACT_THREADS_MAX];
+    int started = 0;
+    for (int t = 0; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, extract_worker, &list) != 0) break;
+        started++;
+    }
+    if (started == 0) {
+        extract_worker(&list);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    uint64_t bytes = 0;
+    int extracted = 0;
+    for (int i = 0; i < list.count; i++) {
+        if (list.jobs[i].failed) {
+            result = 1;
+        } else {
+            extracted++;
+            bytes += list.jobs[i].size;
+        }
+        free(list.jobs[i].host_path);
+    }
+    free(list.jobs);
+
+    printf("Extracted %d files (%llu bytes) to %s\n", extracted, (unsigned long long)bytes, destdir);
+    return result;
+}
+
+// Store 'len' bytes starting 'first_byte' bytes into the physically
+// contiguous region that begins at sector 'snum'. The bytes come from
+// 'data', or, with 'pattern_len' non-zero, 'data' is that many bytes
+// (whole sectors of one fill value) repeated over the range. Partial
+// sectors at the edges are read-modify-written; whole sectors are written
+// straight from 'data' in large requests. Returns 1 with errno set on error.
+static int put_sectors(struct fat_volume *vol, unsigned int snum, uint32_t first_byte, uint32_t len,
+                       const unsigned char *data, size_t pattern_len) {
+    unsigned char sector_buffer[SECTORSIZE_MAX];
+    uint32_t pos = first_byte;
+    uint32_t end = first_byte + len;
+    uint32_t max_sectors = (pattern_len ? pattern_len : vol->extent_io_max) >> SECTOR_SHIFT(vol);
+
+    while (pos < end) {
+        unsigned int s = snum + (pos >> SECTOR_SHIFT(vol));
+        uint32_t intra_sector_offset = pos & SECTOR_MASK(vol);
+        const unsigned char *src = pattern_len ? data : data + (pos - first_byte);
+
+        if (intra_sector_offset != 0 || end - pos < SECTOR_BYTES(vol)) {
+            // Unaligned head or tail
+            uint32_t chunk = SECTOR_BYTES(vol) - intra_sector_offset;
+            if (chunk > end - pos) chunk = end - pos;
+            if (readsector(vol, sector_buffer, s) != 0) {
+                return 1;
+            }
+            memcpy(sector_buffer + intra_sector_offset, src, chunk);
+            if (writesector(vol, sector_buffer, s) != 0) {
+                return 1;
+            }
+            pos += chunk;
+            continue;
+        }
+
+        // Run of fully covered sectors
+        uint32_t sectors = (end - pos) >> SECTOR_SHIFT(vol);
+        if (sectors > max_sectors) sectors = max_sectors;
+        if (writesectors(vol, (unsigned char *)src, s, sectors) != 0) {
+            return 1;
+        }
+        pos += sectors << SECTOR_SHIFT(vol);
+    }
+    return 0;
+}
+
+// Append 'count' newly allocated clusters after 'last' (0 for an empty
+// chain), taking them in as few contiguous runs as possible. Returns the
+// first new cluster, or 0 with errno set and the chain as it was.
+static uint32_t grow_chain(struct fat_volume *vol, uint32_t last, uint32_t count) {
+    if (count > vol->free_count) {
+        errno = ENOSPC;
+        return 0;
+    }
+    uint32_t first = 0;
+    uint32_t old_last = last;
+    while (count > 0) {
+        uint32_t got;
+        uint32_t run = allocate_cluster_run(vol, count, &got);
+        if (run == 0) {
+            int err = errno;
+            if (first != 0) {
+                if (old_last >= 2) set_next_cluster(vol, old_last, FAT_EOC);
+                free_chain(vol, first);
+            }
+            errno = err;
+            return 0;
+        }
+        if (last >= 2) {
+            set_next_cluster(vol, last, run);
+        }
+        if (first == 0) {
+            first = run;
+        }
+        last = run + got - 1;
+        count -= got;
+    }
+    return first;
+}
+
+// Write 'n' bytes at 'offset', which must not lie past the end, into the
+// file of 'file_entry' in 'dir'. Every cluster the write needs is
+// allocated in one batch up front. 'data' and 'pattern_len' are as for
+// put_sectors(). Returns 0, or 1 with errno set.
+static int write_range(struct fat_volume *vol, struct dir_index *dir, struct msdos_dir_entry *file_entry,
+                       uint32_t offset, uint32_t n, const unsigned char *data, size_t pattern_len) {
+    // A FAT file cannot grow past 4 GiB - 1
+    if ((uint64_t)offset + n > UINT32_MAX) {
+        errno = EFBIG;
+        return 1;
+    }
+    uint32_t start_cluster = le16toh(file_entry->start) | (le16toh(file_entry->starthi) << 16);
+    uint32_t file_size = le32toh(file_entry->size);
+    struct chain_index *ci = get_chain_index(vol, start_cluster);
+    if (ci == NULL) {
+        errno = EIO;
+        return 1;
+    }
+
+    int entry_changed = FALSE;
+    uint32_t end = offset + n;
+    uint32_t need = ((uint64_t)end + CLUSTER_MASK(vol)) >> CLUSTER_SHIFT(vol);
+    if (need > ci->nclusters) {
+        if (need - ci->nclusters > vol->free_count) {
+            put_chain_index(vol, ci);
+            errno = ENOSPC;
+            return 1;
+        }
+        uint32_t last = ci->count > 0 ? ci->extents[ci->count - 1].start + ci->extents[ci->count - 1].count - 1 : 0;
+        uint32_t first_new = grow_chain(vol, last, need - ci->nclusters);
+        if (first_new == 0) {
+            put_chain_index(vol, ci);
+            return 1;
+        }
+        if (start_cluster < 2) {
+            // An empty file has no cluster yet; the new chain becomes its start
+            start_cluster = first_new;
+            file_entry->start = htole16(start_cluster & 0xFFFF);
+            file_entry->starthi = htole16(start_cluster >> 16);
+            entry_changed = TRUE;
+        }
+        put_chain_index(vol, ci);
+        ci = get_chain_index(vol, start_cluster);
+        if (ci == NULL) {
+            errno = EIO;
+            return 1;
+        }
+    }
+
+    // Store the part of each contiguous run that overlaps [offset, end),
+    // starting from the extent that holds 'offset'
+    int result = 0;
+    int e = n > 0 ? chain_index_find(ci, offset >> CLUSTER_SHIFT(vol)) : -1;
+    for (; e >= 0 && e < ci->count; e++) {
+        uint32_t run_offset = ci->first[e] << CLUSTER_SHIFT(vol);
+        if (run_offset >= end) break;
+        uint32_t run_bytes = ci->extents[e].count << CLUSTER_SHIFT(vol);
+        uint32_t lo = offset > run_offset ? offset : run_offset;
+        uint32_t hi = end < run_offset + run_bytes ? end : run_offset + run_bytes;
+        if (lo < hi &&
+            put_sectors(vol, cluster_to_sector(vol, ci->extents[e].start), lo - run_offset, hi - lo,
+                        pattern_len ? data : data + (lo - offset), pattern_len) != 0) {
+            result = 1;
+            break;
+        }
+    }
+    put_chain_index(vol, ci);
+
+    // Update the file size if we wrote past the original end
+    if (result == 0 && end > file_size) {
+        file_entry->size = htole32(end);
+        entry_changed = TRUE;
+    }
+    if (entry_changed && dir_write_entry(vol, dir, file_entry) != 0) {
+        result = 1;
+    }
+    return result;
+}
+
+static int write_to_file(struct fat_volume *vol, const char *filename, int offset, int n, int data) {
+    struct dir_index *dir;
+    struct msdos_dir_entry *file_entry = find_file_entry(vol, filename, &dir);
+    if (file_entry == NULL) {
+        printf("File not found: %s\n", filename);
+        return 1;
+    }
+
+    // Check if the offset exceeds the file size
+    uint32_t file_size = le32toh(file_entry->size);
+    if (offset < 0 || n < 0 || offset > file_size) {
+        printf("Offset exceeds file size. File size: %u bytes\n", file_size);
+        return 1;
+    }
+
+    // The fill value over whole sectors, up to one full-sized request
+    size_t pattern_len = ((size_t)n + SECTOR_MASK(vol)) & ~(size_t)SECTOR_MASK(vol);
+    if (pattern_len > vol->extent_io_max) pattern_len = vol->extent_io_max;
+    if (pattern_len == 0) pattern_len = SECTOR_BYTES(vol);
+    unsigned char *pattern = malloc(pattern_len);
+    if (pattern == NULL) {
+        perror("Failed to allocate fill buffer");
+        return 1;
+    }
+    memset(pattern, (unsigned char)data, pattern_len);
+
+    int result = write_range(vol, dir, file_entry, offset, n, pattern, pattern_len);
+    free(pattern);
+    if (result == 0) {
+        printf("Successfully wrote %d bytes to %s\n", n, filename);
+    } else {
+        perror(filename);
+    }
+    return result;
+}
+
+
+
+// Release every cluster of the chain starting at 'cluster_num'. Returns
+// -1 (errno EINVAL) if the chain points outside the volume.
+static int free_chain(struct fat_volume *vol, uint32_t cluster_num) {
+    while (cluster_num < FAT_EOC && cluster_num >= 2) {
+        uint32_t next_cluster = get_next_cluster(vol, cluster_num);
+        if (set_next_cluster(vol, cluster_num, 0) != 0) {  // Mark cluster as free
+            return -1;
+        }
+        cluster_num = next_cluster;
+    }
+    return 0;
+}
+
+static int read_full(int in, unsigned char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(in, buf + done, len - done);
+        if (n <= 0) return 1;
+        done += n;
+    }
+    return 0;
+}
+
+// Copy a host file into the image as NAME (default: the host file's base
+// name), replacing any existing file of that name. The whole chain is
+// reserved up front in as few contiguous runs as the free space allows,
+// and the data is streamed run by run in large writes.
+static int import_file(struct fat_volume *vol, const char *hostfile, const char *filename) {
+    if (filename == NULL) {
+        const char *slash = strrchr(hostfile, '/');
+        filename = slash ? slash + 1 : hostfile;
+    }
+
+    int in = open(hostfile, O_RDONLY);
+    if (in < 0) {
+        perror(hostfile);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > UINT32_MAX) {
+        printf("Cannot import %s: not a regular file below 4 GiB\n", hostfile);
+        close(in);
+        return 1;
+    }
+    uint32_t file_size = st.st_size;
+    uint32_t need = (file_size + CLUSTER_MASK(vol)) >> CLUSTER_SHIFT(vol);
+    if (need > vol->free_count) {
+        printf("Not enough free space for %s: %u clusters needed, %u free\n", hostfile, need, vol->free_count);
+        close(in);
+        return 1;
+    }
+
+    unsigned char name[11];
+    struct dir_index *dir = resolve_parent(vol, filename, name);
+    if (dir == NULL) {
+        printf("%s: %s\n", resolve_error(errno), filename);
+        close(in);
+        return 1;
+    }
+    struct msdos_dir_entry *file_entry = dir_lookup(dir, name);
+    if (file_entry != NULL && (file_entry->attr & ATTR_DIR)) {
+        printf("Is a directory: %s\n", filename);
+        close(in);
+        return 1;
+    }
+
+    unsigned char *buffer = NULL;
+    if (posix_memalign((void **)&buffer, 4096, vol->extent_io_max) != 0) {
+        perror("Failed to allocate import buffer");
+        close(in);
+        return 1;
+    }
+
+    // Reserve the whole chain first; the FAT is written once at the next flush
+    uint32_t start_cluster = need > 0 ? grow_chain(vol, 0, need) : 0;
+    if (need > 0 && start_cluster == 0) {
+        perror(hostfile);
+        free(buffer);
+        close(in);
+        return 1;
+    }
+    struct extent *extents = NULL;
+    int n_extents = 0;
+    if (start_cluster != 0) {
+        n_extents = get_chain_extents(vol, start_cluster, &extents);
+    }
+
+    int result = 1;
+    uint32_t done = 0;
+    const uint32_t max_clusters = vol->extent_io_max >> CLUSTER_SHIFT(vol);
+    for (int e = 0; e < n_extents; e++) {
+        uint32_t c = extents[e].start;
+        uint32_t left = extents[e].count;
+        while (left > 0) {
+            uint32_t count = left < max_clusters ? left : max_clusters;
+            size_t len = (size_t)count * CLUSTER_BYTES(vol);
+            size_t data_len = len < file_size - done ? len : file_size - done;
+            if (read_full(in, buffer, data_len) != 0) {
+                perror(hostfile);
+                free_chain(vol, start_cluster);
+                goto out;
+            }
+            memset(buffer + data_len, 0, len - data_len);   // pad the last cluster
+            if (writeextent(vol, buffer, c, count) != 0) {
+                perror("Failed to write file data");
+                free_chain(vol, start_cluster);
+                goto out;
+            }
+            done += data_len;
+            c += count;
+            left -= count;
+        }
+    }
+
+    // Point the directory entry at the new chain in one update
+    if (file_entry != NULL) {
+        free_chain(vol, le16toh(file_entry->start) | (le16toh(file_entry->starthi) << 16));
+    } else {
+        file_entry = dir_add_entry(vol, dir, name);
+        if (file_entry == NULL) {
+            fprintf(stderr, "No free directory entry found: %s\n", strerror(errno));
+            free_chain(vol, start_cluster);
+            goto out;
+        }
+        file_entry->attr = ATTR_ARCH;
+    }
+    file_entry->start = htole16(start_cluster & 0xFFFF);
+    file_entry->starthi = htole16(start_cluster >> 16);
+    file_entry->size = htole32(file_size);
+    if (dir_write_entry(vol, dir, file_entry) != 0) {
+        perror("Failed to write directory sector");
+        goto out;
+    }
+
+    result = 0;
+    printf("File imported: %s (%u bytes in %d extent%s)\n", filename, file_size,
+           n_extents, n_extents == 1 ? "" : "s");
+out:
+    free(extents);
+    free(buffer);
+    close(in);
+    return result;
+}
+
+// -I: import every file named in a manifest, many at once. Each worker
+// allocates from its own zone of the cluster space, editing the FAT and
+// free map only inside it, and writes file data directly; the shared
+// counters and the directory entries are brought up to date afterwards
+// by this thread alone. Files that do not fit in their worker's zone are
+// imported one at a time at the end.
+
+// Claim up to 'want' free clusters of 'zone' as a chain ending in FAT_EOC,
+// preferring the first run long enough. The zone must have a free cluster.
+static uint32_t zone_claim(struct fat_volume *vol, struct import_zone *zone, uint32_t want, uint32_t *got) {
+    uint32_t best_start = 0, best_len = 0;
+    uint64_t scanned = 0;
+    for (int pass = 0; pass < 2 && best_len < want; pass++) {
+        uint32_t c = (pass == 0) ? zone->next : zone->start;
+        uint32_t limit = (pass == 0) ? zone->end : zone->next;
+        while (c < limit) {
+            uint32_t from = c;
+            c = scan_free_map(vol, c, limit, TRUE);
+            if (c >= limit) break;
+            uint32_t end = scan_free_map(vol, c, limit, FALSE);
+            scanned += (c - from) + (end - c < want ? end - c : want);
+            if (end - c > best_len) {
+                best_start = c;
+                best_len = end - c;
+                if (best_len >= want) break;
+            }
+            c = end;
+        }
+    }
+    STAT_ADD(vol, alloc_scanned, scanned);
+    STAT_ADD(vol, allocations, 1);
+
+    uint32_t len = best_len > want ? want : best_len;
+    for (uint32_t i = 0; i < len; i++) {
+        uint32_t c = best_start + i;
+        uint32_t next = i + 1 < len ? c + 1 : FAT_EOC;
+        vol->fat_table[c] = (vol->fat_table[c] & 0xF0000000) | next;
+        vol->free_map[c >> 6] &= ~(1ULL << (c & 63));
+        vol->fat_dirty[(c * 4) >> SECTOR_SHIFT(vol)] = TRUE;
+    }
+    zone->next = best_start + len < zone->end ? best_start + len : zone->start;
+    zone->free -= len;
+    zone->claimed += len;
+    zone->allocations++;
+    *got = len;
+    return best_start;
+}
+
+// Give back a chain that zone_claim() built
+static void zone_release(struct fat_volume *vol, struct import_zone *zone, uint32_t cluster) {
+    while (cluster >= 2 && cluster < FAT_EOC) {
+        uint32_t next = vol->fat_table[cluster] & 0x0FFFFFFF;
+        vol->fat_table[cluster] &= 0xF0000000;
+        vol->free_map[cluster >> 6] |= 1ULL << (cluster & 63);
+        vol->fat_dirty[(cluster * 4) >> SECTOR_SHIFT(vol)] = TRUE;
+        zone->free++;
+        zone->claimed--;
+        cluster = next;
+    }
+}
+
+// Copy one host file into clusters of 'zone'. Returns IMPORT_WRITTEN,
+// IMPORT_DEFERRED if the zone is too full, or IMPORT_FAILED.
+static int import_into_zone(struct fat_volume *vol, struct import_zone *zone, struct import_job *job,
+                            unsigned char *buffer) {
+    int in = open(job->host_path, O_RDONLY);
+    if (in < 0) {
+        perror(job->host_path);
+        return IMPORT_FAILED;
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > UINT32_MAX) {
+        printf("Cannot import %s: not a regular file below 4 GiB\n", job->host_path);
+        close(in);
+        return IMPORT_FAILED;
+    }
+    job->size = st.st_size;
+    uint32_t need = (job->size + CLUSTER_MASK(vol)) >> CLUSTER_SHIFT(vol);
+    if (need > zone->free) {
+        close(in);
+        return IMPORT_DEFERRED;
+    }
+
+    // Chain the runs as they are claimed; one file's runs stay together
+    uint32_t last = 0;
+    job->start_cluster = 0;
+    job->extents = 0;
+    int state = IMPORT_WRITTEN;
+    uint32_t done = 0;
+    const uint32_t max_clusters = vol->extent_io_max >> CLUSTER_SHIFT(vol);
+    while (need > 0 && state == IMPORT_WRITTEN) {
+        uint32_t got;
+        uint32_t run = zone_claim(vol, zone, need, &got);
+        if (last >= 2) {
+            vol->fat_table[last] = (vol->fat_table[last] & 0xF0000000) | run;
+        } else {
+            job->start_cluster = run;
+        }
+        last = run + got - 1;
+        need -= got;
+        job->extents++;
+
+        for (uint32_t c = run; c <= last && state == IMPORT_WRITTEN; c += max_clusters) {
+            uint32_t count = last - c + 1 < max_clusters ? last - c + 1 : max_clusters;
+            size_t len = (size_t)count * CLUSTER_BYTES(vol);
+            size_t data_len = len < job->size - done ? len : job->size - done;
+            if (read_full(in, buffer, data_len) != 0) {
+                perror(job->host_path);
+                state = IMPORT_FAILED;
+                break;
+            }
+            memset(buffer + data_len, 0, len - data_len);   // pad the last cluster
+            if (writeextent(vol, buffer, c, count) != 0) {
+                perror("Failed to write file data");
+                state = IMPORT_FAILED;
+                break;
+            }
+            done += data_len;
+        }
+    }
+    if (state != IMPORT_WRITTEN) {
+        zone_release(vol, zone, job->start_cluster);
+        job->start_cluster = 0;
+    }
+    close(in);
+    return state;
+}
+
+static void *import_worker(void *arg) {
+    struct import_zone *zone = arg;
+    struct import_list *list = zone->list;
+    struct fat_volume *vol = list->vol;
+    unsigned char *buffer = NULL;
+    if (posix_memalign((void **)&buffer, 4096, vol->extent_io_max) != 0) {
+        // Leave this worker's share to the others
+        return NULL;
+    }
+    for (;;) {
+        int i = __atomic_fetch_add(&list->next, 1, __ATOMIC_RELAXED);
+        if (i >= list->count) break;
+        struct import_job *job = &list->jobs[i];
+        if (job->state == IMPORT_PENDING) {
+            job->state = import_into_zone(vol, zone, job, buffer);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Split the free clusters into 'n' zones of about equal free space
+static void split_zones(struct fat_volume *vol, struct import_zone *zones, int n) {
+    uint32_t align = SECTOR_BYTES(vol) / 4;
+    if (align < 64) align = 64;
+    uint32_t words = (vol->cluster_count + 63) / 64;
+    uint32_t share = vol->free_count / n + 1;
+    uint32_t seen = 0;
+    int z = 0;
+    zones[0].start = 2;
+    for (uint32_t w = 0; w < words; w++) {
+        uint32_t c = w << 6;
+        if (z < n - 1 && c % align == 0 && seen >= share * (z + 1)) {
+            zones[z].end = c;
+            zones[++z].start = c;
+        }
+        uint32_t bits = __builtin_popcountll(vol->free_map[w]);
+        seen += bits;
+        zones[z].free += bits;
+    }
+    zones[z].end = vol->cluster_count;
+    // Any zones left over are empty, so their workers defer every file
+    while (++z < n) {
+        zones[z].start = zones[z].end = vol->cluster_count;
+    }
+    for (z = 0; z < n; z++) {
+        zones[z].next = zones[z].start;
+    }
+}
+
+static int add_import_job(struct import_list *list, const char *host_path, const char *name) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        struct import_job *grown = realloc(list->jobs, capacity * sizeof(*grown));
+        if (grown == NULL) return 1;
+        list->jobs = grown;
+        list->capacity = capacity;
+    }
+    struct import_job *job = &list->jobs[list->count];
+    memset(job, 0, sizeof(*job));
+    job->host_path = strdup(host_path);
+    job->name = strdup(name);
+    if (job->host_path == NULL || job->name == NULL) {
+        free(job->host_path);
+        free(job->name);
+        return 1;
+    }
+    list->count++;
+    return 0;
+}
+
+// Point a directory entry at a chain a worker wrote
+static int link_imported(struct fat_volume *vol, struct import_job *job) {
+    unsigned char name[11];
+    struct dir_index *dir = resolve_parent(vol, job->name, name);
+    struct msdos_dir_entry *file_entry = dir != NULL ? dir_lookup(dir, name) : NULL;
+    if (dir == NULL || (file_entry != NULL && (file_entry->attr & ATTR_DIR))) {
+        printf("%s: %s\n", dir == NULL ? resolve_error(errno) : "Is a directory", job->name);
+        free_chain(vol, job->start_cluster);
+        return 1;
+    }
+    if (file_entry != NULL) {
+        free_chain(vol, le16toh(file_entry->start) | (le16toh(file_entry->starthi) << 16));
+    } else {
+        file_entry = dir_add_entry(vol, dir, name);
+        if (file_entry == NULL) {
+            fprintf(stderr, "No free directory entry found: %s\n", strerror(errno));
+            free_chain(vol, job->start_cluster);
+            return 1;
+        }
+        file_entry->attr = ATTR_ARCH;
+    }
+    file_entry->start = htole16(job->start_cluster & 0xFFFF);
+    file_entry->starthi = htole16(job->start_cluster >> 16);
+    file_entry->size = htole32(job->size);
+    if (dir_write_entry(vol, dir, file_entry) != 0) {
+        perror("Failed to write directory sector");
+        return 1;
+    }
+    printf("File imported: %s (%u bytes in %d extent%s)\n", job->name, job->size,
+           job->extents, job->extents == 1 ? "" : "s");
+    return 0;
+}
+
+// Import the files listed in 'manifest' ("-" for stdin), one per line as
+// "HOSTFILE [NAME]"; blank lines and lines starting with '#' are skipped
+static int import_list(struct fat_volume *vol, const char *manifest) {
+    FILE *in = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (in == NULL) {
+        perror(manifest);
+        return 1;
+    }
+    struct import_list list = { .vol = vol };
+    int result = 0;
+    char line[2 * PATH_MAX];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char *save = NULL;
+        char *host = strtok_r(line, " \t\r\n", &save);
+        if (host == NULL || host[0] == '#') continue;
+        char *name = strtok_r(NULL, " \t\r\n", &save);
+        if (name == NULL) {
+            char *slash = strrchr(host, '/');
+            name = slash ? slash + 1 : host;
+        }
+        if (add_import_job(&list, host, name) != 0) {
+            perror("Failed to read manifest");
+            result = 1;
+            break;
+        }
+        // Catch bad names before any data is written for them
+        unsigned char raw[11];
+        if (resolve_parent(vol, name, raw) == NULL) {
+            printf("%s: %s\n", resolve_error(errno), name);
+            list.jobs[list.count - 1].state = IMPORT_FAILED;
+        }
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    // Workers bypass the sector cache, so it must hold nothing they could
+    // overwrite, and they must not share the overlay or change map
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    if (nthreads > IMPORT_THREADS_MAX) nthreads = IMPORT_THREADS_MAX;
+    if (nthreads > list.count) nthreads = list.count;
+    if (nthreads < 1 || vol->overlay != NULL || vol->changes != NULL) nthreads = 1;
+    if (result == 0 && list.count > 0 && flush_cache(vol) != 0) {
+        result = 1;
+    }
+
+    if (result == 0 && list.count > 0) {
+        struct import_zone zones[IMPORT_THREADS_MAX];
+        memset(zones, 0, sizeof(zones));
+        split_zones(vol, zones, nthreads);
+        vol->needs_sync = TRUE;
+        pthread_t threads[IMPORT_THREADS_MAX];
+        int started = 0;
+        for (int t = 0; t < nthreads; t++) {
+            zones[t].list = &list;
+            if (pthread_create(&threads[t], NULL, import_worker, &zones[t]) != 0) break;
+            started++;
+        }
+        if (started == 0) {
+            import_worker(&zones[0]);
+        }
+        for (int t = 0; t < started; t++) {
+            pthread_join(threads[t], NULL);
+        }
+
+        // Fold what the workers claimed into the volume's own bookkeeping
+        uint32_t claimed = 0;
+        for (int t = 0; t < nthreads; t++) {
+            claimed += zones[t].claimed;
+            if (zones[t].allocations > 0) {
+                vol->next_free_hint = zones[t].next;
+            }
+        }
+        vol->free_count -= claimed;
+        vol->fat_generation++;
+        vol->fsinfo_dirty = TRUE;
+
+        // Directory entries go in one at a time, in manifest order; files
+        // no worker took (or that did not fit its zone) are imported here
+        for (int i = 0; i < list.count; i++) {
+            struct import_job *job = &list.jobs[i];
+            if (job->state == IMPORT_WRITTEN) {
+                result |= link_imported(vol, job);
+            } else if (job->state == IMPORT_FAILED) {
+                result = 1;
+            } else {
+                result |= import_file(vol, job->host_path, job->name);
+            }
+        }
+    }
+
+    for (int i = 0; i < list.count; i++) {
+        free(list.jobs[i].host_path);
+        free(list.jobs[i].name);
+    }
+    free(list.jobs);
+    return result;
+}
+
+
+static int collect_chain(struct fat_volume *vol, struct dir_index *dir, struct msdos_dir_entry *entry,
+                         const char *path, void *arg) {
+    struct chain_list *list = arg;
+    uint32_t start = le16toh(entry->start) | (le16toh(entry->starthi) << 16);
+    if (start < 2) {
+        return 0;   // empty file
+    }
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        struct chain_info *grown = realloc(list->chains, capacity * sizeof(*grown));
+        if (grown == NULL) return 1;
+        list->chains = grown;
+        list->capacity = capacity;
+    }
+
+    struct extent *extents = NULL;
+    int n = get_chain_extents(vol, start, &extents);
+    if (n < 0) {
+        fprintf(stderr, "Corrupt cluster chain in %s\n", path);
+        return 1;
+    }
+    struct chain_info *chain = &list->chains[list->count++];
+    chain->dir = dir;
+    chain->entry = entry - (struct msdos_dir_entry *)dir->data;
+    chain->start = start;
+    chain->clusters = 0;
+    for (int e = 0; e < n; e++) chain->clusters += extents[e].count;
+    chain->extents = n;
+    chain->is_dir = (entry->attr & ATTR_DIR) != 0;
+    free(extents);
+    return 0;
+}
+
+static void report_fragmentation(const char *when, struct chain_list *list) {
+    uint64_t clusters = 0, extents = 0;
+    int fragmented = 0;
+    for (int i = 0; i < list->count; i++) {
+        clusters += list->chains[i].clusters;
+        extents += list->chains[i].extents;
+        if (list->chains[i].extents > 1) fragmented++;
+    }
+    // Share of cluster-to-cluster links that jump instead of continuing
+    uint64_t links = clusters - list->count;
+    double ratio = links ? 100.0 * (extents - list->count) / links : 0.0;
+    printf("%s: %d chains, %d fragmented, %llu extents, fragmentation %.2f%%\n",
+           when, list->count, fragmented, (unsigned long long)extents, ratio);
+}
+
+// Copy a chain into the contiguous run at 'target', extent by extent
+static int copy_chain(struct fat_volume *vol, uint32_t start, uint32_t target, unsigned char *buffer) {
+    struct extent *extents = NULL;
+    int n = get_chain_extents(vol, start, &extents);
+    if (n < 0) return 1;
+
+    const uint32_t max_clusters = vol->extent_io_max >> CLUSTER_SHIFT(vol);
+    for (int e = 0; e < n; e++) {
+        uint32_t c = extents[e].start;
+        uint32_t left = extents[e].count;
+        while (left > 0) {
+            uint32_t count = left < max_clusters ? left : max_clusters;
+            if (readextent(vol, buffer, c, count) != 0 || writeextent(vol, buffer, target, count) != 0) {
+                free(extents);
+                return 1;
+            }
+            c += count;
+            target += count;
+            left -= count;
+        }
+    }
+    free(extents);
+    return 0;
+}
+
+// Rewrite every fragmented file as one contiguous extent. Each move is
+// crash safe: the data is copied into a newly claimed run and made durable
+// first, then the directory entry is switched to it and made durable, and
+// only then is the old chain freed.
+static int defragment(struct fat_volume *vol) {
+    struct chain_list list = { 0 };
+    if (walk_tree(vol, vol->root_cluster, "", 0, collect_chain, &list) != 0) {
+        printf("Cannot defragment: the directory tree is damaged\n");
+        free(list.chains);
+        return 1;
+    }
+    report_fragmentation("Before", &list);
+
+    unsigned char *buffer = malloc(vol->extent_io_max);
+    if (buffer == NULL) {
+        perror("Failed to allocate copy buffer");
+        free(list.chains);
+        return 1;
+    }
+
+    int moved = 0, skipped = 0, result = 0;
+    for (int i = 0; i < list.count; i++) {
+        struct chain_info *chain = &list.chains[i];
+        if (chain->extents <= 1) continue;
+        if (chain->is_dir) {
+            // Moving a directory would also mean rewriting "." and every
+            // child's ".."; directories are reported but left in place
+            skipped++;
+            continue;
+        }
+
+        uint32_t len;
+        uint32_t target = find_free_run(vol, chain->clusters, &len);
+        if (len < chain->clusters) {
+            skipped++;
+            continue;
+        }
+
+        claim_cluster_run(vol, target, chain->clusters);
+        if (copy_chain(vol, chain->start, target, buffer) != 0 || flush_image(vol) != 0) {
+            perror("Failed to copy file data");
+            free_chain(vol, target);
+            result = 1;
+            break;
+        }
+
+        struct msdos_dir_entry *entry = (struct msdos_dir_entry *)chain->dir->data + chain->entry;
+        entry->start = htole16(target & 0xFFFF);
+        entry->starthi = htole16(target >> 16);
+        if (dir_write_entry(vol, chain->dir, entry) != 0 || flush_image(vol) != 0) {
+            perror("Failed to update directory entry");
+            result = 1;
+            break;
+        }
+
+        free_chain(vol, chain->start);
+        chain->start = target;
+        chain->extents = 1;
+        moved++;
+    }
+    free(buffer);
+
+    printf("Defragmented %d files, skipped %d\n", moved, skipped);
+    report_fragmentation("After", &list);
+    free(list.chains);
+    return result;
+}
+
+// Count free, end-of-chain, bad and invalid entries of one slice of the
+// FAT, four entries at a time, and compare the slice's sectors against
+// every other FAT copy.
+static void *scan_fat_slice(void *arg) {
+    struct fat_scan *scan = arg;
+    struct fat_volume *vol = scan->vol;
+    typedef uint32_t v4u __attribute__((vector_size(16)));
+    const v4u mask = { 0x0FFFFFFF, 0x0FFFFFFF, 0x0FFFFFFF, 0x0FFFFFFF };
+    const v4u zero = { 0, 0, 0, 0 };
+    const v4u one = { 1, 1, 1, 1 };
+    const v4u bad = { 0x0FFFFFF7, 0x0FFFFFF7, 0x0FFFFFF7, 0x0FFFFFF7 };
+    const v4u eoc = { FAT_EOC, FAT_EOC, FAT_EOC, FAT_EOC };
+    const v4u limit = { vol->cluster_count, vol->cluster_count, vol->cluster_count, vol->cluster_count };
+    v4u n_free = zero, n_eoc = zero, n_bad = zero, n_invalid = zero;
+
+    uint32_t c = scan->first;
+    for (; c + 4 <= scan->last; c += 4) {
+        v4u v;
+        memcpy(&v, vol->fat_table + c, sizeof(v));
+        v &= mask;
+        // Comparisons yield -1 in every matching lane
+        n_free -= (v4u)(v == zero);
+        n_eoc -= (v4u)(v >= eoc);
+        n_bad -= (v4u)(v == bad);
+        n_invalid -= (v4u)((v == one) | ((v >= limit) & (v < bad)));
+    }
+    for (int i = 0; i < 4; i++) {
+        scan->free += n_free[i];
+        scan->eoc += n_eoc[i];
+        scan->bad += n_bad[i];
+        scan->invalid += n_invalid[i];
+    }
+    for (; c < scan->last; c++) {
+        uint32_t v = vol->fat_table[c] & 0x0FFFFFFF;
+        if (v == 0) scan->free++;
+        else if (v >= FAT_EOC) scan->eoc++;
+        else if (v == 0x0FFFFFF7) scan->bad++;
+        else if (v == 1 || v >= vol->cluster_count) scan->invalid++;
+    }
+
+    unsigned char *buffer = malloc((size_t)CHECK_FAT_CHUNK << SECTOR_SHIFT(vol));
+    if (buffer == NULL) {
+        scan->diverged = scan->sec_last - scan->sec_first;
+        return NULL;
+    }
+    for (int copy = 1; copy < vol->num_fats; copy++) {
+        for (uint32_t s = scan->sec_first; s < scan->sec_last; s += CHECK_FAT_CHUNK) {
+            uint32_t count = scan->sec_last - s < CHECK_FAT_CHUNK ? scan->sec_last - s : CHECK_FAT_CHUNK;
+            if (readsectors(vol, buffer, vol->reserved_sector_count + copy * vol->sectors_per_fat + s, count) != 0) {
+                scan->diverged += count;
+                continue;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                if (memcmp(buffer + ((size_t)i << SECTOR_SHIFT(vol)),
+                           (unsigned char *)vol->fat_table + ((size_t)(s + i) << SECTOR_SHIFT(vol)), SECTOR_BYTES(vol)) != 0) {
+                    scan->diverged++;
+                }
+            }
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void check_problem(struct check_state *st, const char *path, const char *fmt, uint32_t value) {
+    if (st->problems++ < CHECK_REPORT_MAX) {
+        printf("%s: ", path[0] ? path : "/");
+        printf(fmt, value);
+        printf("\n");
+    }
+}
+
+// Follow one chain, claiming its clusters for chain 'id'. Stops at the
+// first cross-link, cycle or invalid pointer and, when repairing, ends the
+// chain just before it. Returns the number of clusters kept, and sets
+// '*cut_at_start' if the very first cluster was unusable.
+static uint32_t check_chain(struct check_state *st, uint32_t start, const char *path, int *cut_at_start) {
+    struct fat_volume *vol = st->vol;
+    uint32_t id = ++st->next_id;
+    uint32_t prev = 0, length = 0;
+    uint32_t c = start;
+    *cut_at_start = FALSE;
+
+    while (c < FAT_EOC) {
+        const char *problem = NULL;
+        if (c < 2 || c >= vol->cluster_count || c == 0x0FFFFFF7) {
+            problem = "invalid cluster pointer %u";
+            st->bad_pointers++;
+        } else if (st->owner[c] == id) {
+            problem = "cycle back to cluster %u";
+            st->cycles++;
+        } else if (st->owner[c] != 0) {
+            problem = "cross-linked with another chain at cluster %u";
+            st->cross_links++;
+        } else if ((vol->fat_table[c] & 0x0FFFFFFF) == 0) {
+            // The cluster is in use by this chain but marked free
+            problem = "chain runs into free cluster %u";
+            st->bad_pointers++;
+        }
+
+        if (problem != NULL) {
+            check_problem(st, path, problem, c);
+            if (st->repair) {
+                if (prev == 0) {
+                    *cut_at_start = TRUE;
+                } else {
+                    set_next_cluster(vol, prev, FAT_EOC);
+                }
+            }
+            break;
+        }
+
+        st->owner[c] = id;
+        st->used++;
+        length++;
+        prev = c;
+        c = vol->fat_table[c] & 0x0FFFFFFF;
+    }
+    return length;
+}
+
+// Drop clusters past 'keep' from the chain at 'start' (which is already
+// claimed by the current walk) and hand them back to the free map.
+static void trim_chain(struct check_state *st, uint32_t start, uint32_t keep) {
+    struct fat_volume *vol = st->vol;
+    uint32_t c = start;
+    for (uint32_t i = 1; i < keep; i++) {
+        c = vol->fat_table[c] & 0x0FFFFFFF;
+    }
+    uint32_t tail = vol->fat_table[c] & 0x0FFFFFFF;
+    set_next_cluster(vol, c, FAT_EOC);
+    while (tail >= 2 && tail < vol->cluster_count) {
+        uint32_t next = vol->fat_table[tail] & 0x0FFFFFFF;
+        set_next_cluster(vol, tail, 0);
+        st->owner[tail] = 0;
+        st->used--;
+        tail = next;
+    }
+}
+
+static int check_entry(struct fat_volume *vol, struct dir_index *dir, struct msdos_dir_entry *entry,
+                       const char *path, void *arg) {
+    struct check_state *st = arg;
+    uint32_t start = le16toh(entry->start) | (le16toh(entry->starthi) << 16);
+    int is_dir = (entry->attr & ATTR_DIR) != 0;
+    int entry_changed = FALSE;
+
+    if (is_dir) st->dirs++;
+    else st->files++;
+
+    if (start == 0) {
+        if (is_dir) {
+            check_problem(st, path, "directory has start cluster %u", start);
+            return 1;
+        }
+        if (entry->size != 0) {
+            check_problem(st, path, "size %u with no clusters", entry->size);
+            st->size_mismatches++;
+            if (st->repair) {
+                entry->size = 0;
+                entry_changed = TRUE;
+            }
+        }
+    } else {
+        int cut_at_start;
+        uint32_t length = check_chain(st, start, path, &cut_at_start);
+        if (cut_at_start && st->repair) {
+            entry->start = 0;
+            entry->starthi = 0;
+            entry_changed = TRUE;
+        }
+
+        if (!is_dir) {
+            uint32_t need = (entry->size + CLUSTER_MASK(vol)) >> CLUSTER_SHIFT(vol);
+            if (length != need) {
+                st->size_mismatches++;
+                if (length > need) {
+                    check_problem(st, path, "chain is longer than the size needs: %u clusters", length);
+                    if (st->repair) {
+                        if (need == 0) {
+                            trim_chain(st, start, 1);
+                            set_next_cluster(vol, start, 0);
+                            st->owner[start] = 0;
+                            st->used--;
+                            entry->start = 0;
+                            entry->starthi = 0;
+                            entry_changed = TRUE;
+                        } else {
+                            trim_chain(st, start, need);
+                        }
+                    }
+                } else {
+                    check_problem(st, path, "size needs more clusters than the chain has: %u", need);
+                    if (st->repair) {
+                        entry->size = cut_at_start ? 0 : length * CLUSTER_BYTES(vol);
+                        entry_changed = TRUE;
+                    }
+                }
+            }
+        } else if (cut_at_start) {
+            return 1;
+        }
+    }
+
+    if (entry_changed && dir_write_entry(vol, dir, entry) != 0) {
+        perror("Failed to write directory sector");
+        return 1;
+    }
+    return 0;
+}
+
+// Write the first FAT over every other FAT copy
+static int mirror_fat(struct fat_volume *vol) {
+    for (int copy = 1; copy < vol->num_fats; copy++) {
+        if (writesectors(vol, (unsigned char *)vol->fat_table,
+                         vol->reserved_sector_count + copy * vol->sectors_per_fat, vol->sectors_per_fat) != 0) {
+            perror("Failed to write FAT copy");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Validate the whole volume: FAT entry classes and copy divergence (scanned
+// by several threads), then every chain reachable from the root for
+// cross-links, cycles, invalid pointers and size mismatches, and finally
+// allocated clusters nobody reaches. With 'repair' every problem is fixed.
+static int check_image(struct fat_volume *vol, int repair) {
+    struct check_state st = { .vol = vol, .repair = repair };
+    st.owner = calloc(vol->cluster_count, sizeof(uint32_t));
+    if (st.owner == NULL) {
+        perror("Failed to allocate cluster map");
+        return 1;
+    }
+
+    // FAT scan, split into slices that start on sector boundaries
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > CHECK_THREADS_MAX) nthreads = CHECK_THREADS_MAX;
+    if (nthreads < 1) nthreads = 1;
+    struct fat_scan scans[CHECK_THREADS_MAX];
+    pthread_t threads[CHECK_THREADS_MAX];
+    uint32_t per_sector = SECTOR_BYTES(vol) / 4;
+    uint32_t sectors_used = (vol->cluster_count + per_sector - 1) / per_sector;
+    uint32_t slice = (sectors_used + nthreads - 1) / nthreads;
+    for (long t = 0; t < nthreads; t++) {
+        memset(&scans[t], 0, sizeof(scans[t]));
+        scans[t].vol = vol;
+        scans[t].sec_first = t * slice < sectors_used ? t * slice : sectors_used;
+        scans[t].sec_last = (t + 1) * slice < sectors_used ? (t + 1) * slice : sectors_used;
+        scans[t].first = scans[t].sec_first * per_sector;
+        scans[t].last = scans[t].sec_last * per_sector;
+        if (scans[t].first < 2) scans[t].first = 2;
+        if (scans[t].last > vol->cluster_count) scans[t].last = vol->cluster_count;
+        if (scans[t].first > scans[t].last) scans[t].first = scans[t].last;
+    }
+    // Divergence past the clusters in use still counts
+    scans[nthreads - 1].sec_last = vol->sectors_per_fat;
+
+    int started = 0;
+    for (long t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, scan_fat_slice, &scans[t]) != 0) break;
+        started++;
+    }
+    scan_fat_slice(&scans[0]);
+    for (long t = 1; t <= started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    for (long t = started + 1; t < nthreads; t++) {
+        scan_fat_slice(&scans[t]);
+    }
+
+    struct fat_scan total = { 0 };
+    for (long t = 0; t < nthreads; t++) {
+        total.free += scans[t].free;
+        total.eoc += scans[t].eoc;
+        total.bad += scans[t].bad;
+        total.invalid += scans[t].invalid;
+        total.diverged += scans[t].diverged;
+    }
+
+    // Directory tree: root chain first, then everything reachable from it
+    int cut_at_start;
+    st.dirs = 1;
+    check_chain(&st, vol->root_cluster, "", &cut_at_start);
+    if (cut_at_start) {
+        printf("Root directory chain is unusable; cannot continue\n");
+        free(st.owner);
+        return 1;
+    }
+    if (walk_tree(vol, vol->root_cluster, "", 0, check_entry, &st) != 0 && !repair) {
+        printf("Some directories could not be read\n");
+    }
+
+    // Allocated clusters no chain reached; a lost chain starts at a lost
+    // cluster that no other lost cluster points to
+    unsigned char *pointed = calloc(vol->cluster_count, 1);
+    if (pointed == NULL) {
+        perror("Failed to allocate cluster map");
+        free(st.owner);
+        return 1;
+    }
+    for (uint32_t c = 2; c < vol->cluster_count; c++) {
+        uint32_t next = vol->fat_table[c] & 0x0FFFFFFF;
+        if (next != 0 && st.owner[c] == 0 && next >= 2 && next < vol->cluster_count) {
+            pointed[next] = 1;
+        }
+    }
+    for (uint32_t c = 2; c < vol->cluster_count; c++) {
+        uint32_t value = vol->fat_table[c] & 0x0FFFFFFF;
+        if (value == 0 || value == 0x0FFFFFF7 || st.owner[c] != 0) continue;
+        st.lost_clusters++;
+        if (!pointed[c]) st.lost_chains++;
+    }
+    free(pointed);
+    if (st.lost_clusters > 0) {
+        check_problem(&st, "", "%u allocated clusters are not reachable from any file", st.lost_clusters);
+        if (repair) {
+            for (uint32_t c = 2; c < vol->cluster_count; c++) {
+                uint32_t value = vol->fat_table[c] & 0x0FFFFFFF;
+                if (value != 0 && value != 0x0FFFFFF7 && st.owner[c] == 0) {
+                    set_next_cluster(vol, c, 0);
+                }
+            }
+        }
+    }
+
+    if (total.diverged > 0) {
+        check_problem(&st, "", "%u FAT sectors differ between FAT copies", total.diverged);
+    }
+
+    printf("FAT: %u clusters, %u free, %u end-of-chain, %u bad, %u invalid pointers\n",
+           vol->cluster_count - 2, total.free, total.eoc, total.bad, total.invalid);
+    printf("Tree: %u directories, %u files, %u clusters in use\n", st.dirs, st.files, st.used);
+    printf("Problems: %u cross-links, %u cycles, %u bad pointers, %u lost chains (%u clusters), "
+           "%u size mismatches, %u diverging FAT sectors\n",
+           st.cross_links, st.cycles, st.bad_pointers, st.lost_chains, st.lost_clusters,
+           st.size_mismatches, total.diverged);
+
+    int result = 0;
+    if (st.problems == 0) {
+        printf("Image is clean\n");
+    } else if (repair) {
+        // FAT 0 is now authoritative; make every copy match it
+        result = mirror_fat(vol);
+        vol->fsinfo_dirty = TRUE;
+        printf("Repaired %u problems\n", st.problems);
+    } else {
+        printf("Run with --repair to fix %u problems\n", st.problems);
+        result = 1;
+    }
+    free(st.owner);
+    return result;
+}
+
+// Define the helper functions
+
+// First cluster in [from, limit) that is free ('want_free') or used, or
+// 'limit' if there is none. Free-map words from 'limit' on are not read.
+static uint32_t scan_free_map(struct fat_volume *vol, uint32_t from, uint32_t limit, int want_free) {
+    if (from >= limit) return limit;
+    uint64_t flip = want_free ? 0 : ~0ULL;
+    uint32_t w = from >> 6;
+    uint64_t bits = (vol->free_map[w] ^ flip) & (~0ULL << (from & 63));
+    while (bits == 0) {
+        if (++w >= (limit + 63) / 64) return limit;
+        bits = vol->free_map[w] ^ flip;
+    }
+    uint32_t c = (w << 6) + __builtin_ctzll(bits);
+    return c < limit ? c : limit;
+}
+
+// Next free cluster at or after 'from', or cluster_count if there is none
+static uint32_t find_free_cluster(struct fat_volume *vol, uint32_t from) {
+    return scan_free_map(vol, from, vol->cluster_count, TRUE);
+}
+
+// Next used cluster at or after 'from', or cluster_count if there is none
+static uint32_t find_used_cluster(struct fat_volume *vol, uint32_t from) {
+    return scan_free_map(vol, from, vol->cluster_count, FALSE);
+}
+
+// Find the first free run of at least 'want' clusters, scanning from the
+// next-free hint and wrapping around. Returns its start and stores its
+// length (capped at 'want') in 'len'; if no run is long enough, the
+// longest one is returned instead. 'len' is 0 when the volume is full.
+static uint32_t find_free_run(struct fat_volume *vol, uint32_t want, uint32_t *len) {
+    uint32_t best_start = 0, best_len = 0;
+    uint64_t scanned = 0;
+    uint32_t start = vol->next_free_hint;
+    if (start < 2 || start >= vol->cluster_count) start = 2;
+
+    // Scan from the hint to the end, then wrap around to cluster 2
+    for (int pass = 0; pass < 2 && best_len < want; pass++) {
+        uint32_t c = (pass == 0) ? start : 2;
+        uint32_t limit = (pass == 0) ? vol->cluster_count : start;
+        while (c < limit) {
+            uint32_t from = c;
+            c = find_free_cluster(vol, c);
+            if (c >= limit) break;
+            uint32_t end = find_used_cluster(vol, c);
+            if (end > limit) end = limit;
+            scanned += (c - from) + (end - c < want ? end - c : want);
+            if (end - c > best_len) {
+                best_start = c;
+                best_len = end - c;
+                if (best_len >= want) break;
+            }
+            c = end;
+        }
+    }
+
+    STAT_ADD(vol, alloc_scanned, scanned);
+    *len = best_len > want ? want : best_len;
+    return best_start;
+}
+
+// Mark 'len' free clusters from 'start' as one chain ending in FAT_EOC
+static void claim_cluster_run(struct fat_volume *vol, uint32_t start, uint32_t len) {
+    for (uint32_t i = 0; i < len - 1; i++) {
+        set_next_cluster(vol, start + i, start + i + 1);
+    }
+    set_next_cluster(vol, start + len - 1, FAT_EOC);
+
+    vol->next_free_hint = start + len;
+    vol->fsinfo_dirty = TRUE;
+}
+
+// Allocate up to 'want' contiguous clusters, chained and terminated with
+// FAT_EOC. Returns the first cluster and stores the run length in 'got',
+// which is shorter than 'want' only if no long enough run exists.
+// Returns 0 (errno ENOSPC) if the volume is full.
+static uint32_t allocate_cluster_run(struct fat_volume *vol, uint32_t want, uint32_t *got) {
+    uint32_t len;
+    STAT_TIMER(vol, t);
+    uint32_t start = find_free_run(vol, want, &len);
+
+    if (len == 0) {
+        errno = ENOSPC;
+        return 0;
+    }
+
+    claim_cluster_run(vol, start, len);
+    STAT_LATENCY(vol, OP_ALLOCATE, t);
+    STAT_ADD(vol, allocations, 1);
+    *got = len;
+    return start;
+}
+
+// Returns -1 (errno EINVAL) for a cluster outside the volume, which only
+// a corrupt chain leads to
+static int set_next_cluster(struct fat_volume *vol, uint32_t cluster, uint32_t next_cluster) {
+    if (cluster < 2 || cluster >= vol->cluster_count) {
+        errno = EINVAL;
+        return -1;
+    }
+    STAT_ADD(vol, fat_updates, 1);
+    vol->fat_generation++;
+    vol->needs_sync = TRUE;
+
+    // Keep the free map and free count in step with the FAT
+    int was_free = (vol->fat_table[cluster] & 0x0FFFFFFF) == 0;
+    int now_free = (next_cluster & 0x0FFFFFFF) == 0;
+    if (was_free && !now_free) {
+        vol->free_map[cluster >> 6] &= ~(1ULL << (cluster & 63));
+        vol->free_count--;
+        vol->fsinfo_dirty = TRUE;
+    } else if (!was_free && now_free) {
+        vol->free_map[cluster >> 6] |= 1ULL << (cluster & 63);
+        vol->free_count++;
+        vol->fsinfo_dirty = TRUE;
+        if (vol->flags & FAT_OPEN_PUNCH_HOLES) {
+            note_freed_cluster(vol, cluster);
+        }
+    }
+
+    // The top four bits of a FAT32 entry are reserved and must be preserved
+    vol->fat_table[cluster] = (vol->fat_table[cluster] & 0xF0000000) | (next_cluster & 0x0FFFFFFF);
+    vol->fat_dirty[(cluster * 4) >> SECTOR_SHIFT(vol)] = TRUE;
+    return 0;
+}
+
+
+static uint32_t get_next_cluster(struct fat_volume *vol, uint32_t cluster) {
+    STAT_ADD(vol, fat_lookups, 1);
+    if (cluster >= vol->cluster_count) {
+        return FAT_EOC;
+    }
+    return vol->fat_table[cluster] & 0x0FFFFFFF;
+}
+
+// Whether 'c' may appear in an 8.3 name: no control bytes, spaces or
+// any of " * + , / : ; < = > ? [ \ ] |
+static int valid_83_char(unsigned char c) {
+    return c > ' ' && c != 0x7F && strchr("\"*+,/:;<=>?[\\]|", c) == NULL;
+}
+
+// Convert one path component ("file.txt") to its raw, space padded and
+// upper-cased 8.3 form. Returns 1 if the component is not a valid 8.3
+// name: empty, more than 8 characters before the dot or 3 after it, more
+// than one dot, or a character valid_83_char() refuses. Long names are
+// rejected rather than truncated, so two of them can never end up as the
+// same entry.
+static int make_83_name(const char *component, size_t len, unsigned char out[11]) {
+    memset(out, ' ', 11);
+    if (len == 0) return 1;
+
+    // "." and ".." are stored literally
+    if ((len == 1 && component[0] == '.') || (len == 2 && component[0] == '.' && component[1] == '.')) {
+        memcpy(out, component, len);
+        return 0;
+    }
+
+    const char *dot = memchr(component, '.', len);
+    size_t name_len = dot ? (size_t)(dot - component) : len;
+    size_t ext_len = dot ? len - name_len - 1 : 0;
+    if (name_len == 0 || name_len > 8 || ext_len > 3 || (dot && memchr(dot + 1, '.', ext_len) != NULL)) {
+        return 1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (component + i != dot && !valid_83_char(component[i])) return 1;
+    }
+
+    for (size_t i = 0; i < name_len; i++) {
+        out[i] = toupper((unsigned char)component[i]);
+    }
+    for (size_t i = 0; i < ext_len; i++) {
+        out[8 + i] = toupper((unsigned char)dot[1 + i]);
+    }
+    return 0;
+}
+
+// FNV-1a over the upper-cased raw name, so older lower-case entries match too
+static uint32_t name_hash(const unsigned char *name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 11; i++) {
+        h = (h ^ toupper(name[i])) * 16777619u;
+    }
+    return h;
+}
+
+static int names_equal(const unsigned char *a, const unsigned char *b) {
+    for (int i = 0; i < 11; i++) {
+        if (toupper(a[i]) != toupper(b[i])) return FALSE;
+    }
+    return TRUE;
+}
+
+static int entry_is_indexed(const struct msdos_dir_entry *e) {
+    return e->name[0] != 0x00 && e->name[0] != DELETED_FLAG &&
+           e->attr != ATTR_EXT && !(e->attr & ATTR_VOLUME);
+}
+
+static void dir_hash_insert(struct dir_index *dir, uint32_t i) {
+    struct msdos_dir_entry *e = (struct msdos_dir_entry *)dir->data + i;
+    uint32_t b = name_hash(e->name) & (dir->nbuckets - 1);
+    dir->next[i] = dir->buckets[b];
+    dir->buckets[b] = i;
+}
+
+static void dir_hash_remove(struct dir_index *dir, uint32_t i) {
+    struct msdos_dir_entry *e = (struct msdos_dir_entry *)dir->data + i;
+    int32_t *pp = &dir->buckets[name_hash(e->name) & (dir->nbuckets - 1)];
+    while (*pp != -1) {
+        if (*pp == (int32_t)i) {
+            *pp = dir->next[i];
+            return;
+        }
+        pp = &dir->next[*pp];
+    }
+}
+
+// (Re)build the hash index over every live entry of a loaded directory
+static int dir_build_index(struct dir_index *dir) {
+    uint32_t nbuckets = 64;
+    while (nbuckets < dir->capacity) nbuckets <<= 1;
+
+    // The old index stays usable if memory runs out
+    int32_t *buckets = malloc(nbuckets * sizeof(int32_t));
+    int32_t *next = malloc(dir->capacity * sizeof(int32_t));
+    if (buckets == NULL || next == NULL) {
+        free(buckets);
+        free(next);
+        return 1;
+    }
+    free(dir->buckets);
+    free(dir->next);
+    dir->nbuckets = nbuckets;
+    dir->buckets = buckets;
+    dir->next = next;
+    memset(dir->buckets, 0xFF, nbuckets * sizeof(int32_t));
+
+    struct msdos_dir_entry *entries = (struct msdos_dir_entry *)dir->data;
+    dir->end = dir->capacity;
+    dir->free_hint = dir->capacity;
+    for (uint32_t i = 0; i < dir->capacity; i++) {
+        if (entries[i].name[0] == 0x00) {
+            dir->end = i;
+            break;
+        }
+        if (entries[i].name[0] == DELETED_FLAG && i < dir->free_hint) {
+            dir->free_hint = i;
+        }
+        if (entry_is_indexed(&entries[i])) {
+            dir_hash_insert(dir, i);
+        }
+    }
+    if (dir->end < dir->free_hint) dir->free_hint = dir->end;
+    return 0;
+}
+
+static void free_dir(struct dir_index *dir) {
+    if (dir == NULL) return;
+    free(dir->clusters);
+    free(dir->data);
+    free(dir->buckets);
+    free(dir->next);
+    free(dir);
+}
+
+// Read a whole directory (every cluster of its chain) and index it.
+// Returns NULL with errno EIO (corrupt chain, failed read) or ENOMEM.
+static struct dir_index *read_dir(struct fat_volume *vol, uint32_t start_cluster) {
+    struct extent *extents = NULL;
+    int n = get_chain_extents(vol, start_cluster, &extents);
+    if (n <= 0) {
+        free(extents);
+        errno = EIO;
+        return NULL;
+    }
+
+    struct dir_index *dir = calloc(1, sizeof(*dir));
+    uint32_t nclusters = 0;
+    for (int e = 0; e < n; e++) nclusters += extents[e].count;
+    if (dir != NULL) {
+        dir->clusters = malloc(nclusters * sizeof(uint32_t));
+        dir->data = malloc((size_t)nclusters * CLUSTER_BYTES(vol));
+    }
+    if (dir == NULL || dir->clusters == NULL || dir->data == NULL) {
+        goto fail_nomem;
+    }
+
+    dir->start_cluster = start_cluster;
+    for (int e = 0; e < n; e++) {
+        if (readextent(vol, dir->data + (size_t)dir->nclusters * CLUSTER_BYTES(vol),
+                       extents[e].start, extents[e].count) != 0) {
+            free_dir(dir);
+            free(extents);
+            errno = EIO;
+            return NULL;
+        }
+        for (uint32_t i = 0; i < extents[e].count; i++) {
+            dir->clusters[dir->nclusters++] = extents[e].start + i;
+        }
+    }
+    free(extents);
+    extents = NULL;
+
+    dir->capacity = nclusters * CLUSTER_BYTES(vol) / sizeof(struct msdos_dir_entry);
+    if (dir_build_index(dir) != 0) {
+        goto fail_nomem;
+    }
+    return dir;
+
+fail_nomem:
+    free_dir(dir);
+    free(extents);
+    errno = ENOMEM;
+    return NULL;
+}
+
+// The loaded directory starting at 'start_cluster'. Loaded directories stay
+// cached until the volume is closed; readers fill the cache concurrently.
+static struct dir_index *load_dir(struct fat_volume *vol, uint32_t start_cluster) {
+    if (start_cluster < 2) start_cluster = vol->root_cluster;   // ".." of a top-level dir
+
+    pthread_mutex_lock(&vol->dir_lock);
+    struct dir_index *dir = vol->dir_cache;
+    while (dir != NULL && dir->start_cluster != start_cluster) {
+        dir = dir->link;
+    }
+    if (dir == NULL && (dir = read_dir(vol, start_cluster)) != NULL) {
+        dir->link = vol->dir_cache;
+        vol->dir_cache = dir;
+    }
+    pthread_mutex_unlock(&vol->dir_lock);
+    return dir;
+}
+
+static struct msdos_dir_entry *dir_lookup(struct dir_index *dir, const unsigned char name[11]) {
+    struct msdos_dir_entry *entries = (struct msdos_dir_entry *)dir->data;
+    for (int32_t i = dir->buckets[name_hash(name) & (dir->nbuckets - 1)]; i != -1; i = dir->next[i]) {
+        if (names_equal(entries[i].name, name)) return &entries[i];
+    }
+    return NULL;
+}
+
+// Write the sector holding 'entry' back to the disk
+static int dir_write_entry(struct fat_volume *vol, struct dir_index *dir, struct msdos_dir_entry *entry) {
+    size_t offset = (unsigned char *)entry - dir->data;
+    size_t sector_offset = offset & ~(size_t)SECTOR_MASK(vol);
+    unsigned int snum = cluster_to_sector(vol, dir->clusters[offset >> CLUSTER_SHIFT(vol)]) +
+                        ((offset & CLUSTER_MASK(vol)) >> SECTOR_SHIFT(vol));
+    return writesector(vol, dir->data + sector_offset, snum);
+}
+
+// Take a free slot in 'dir' for 'name', growing the directory by a zeroed
+// cluster when it is full. The slot is indexed but not yet written.
+// Returns NULL with errno set (ENOSPC, ENOMEM, EIO) on failure.
+static struct msdos_dir_entry *dir_add_entry(struct fat_volume *vol, struct dir_index *dir, const unsigned char name[11]) {
+    struct msdos_dir_entry *entries = (struct msdos_dir_entry *)dir->data;
+    uint32_t i = dir->free_hint;
+    while (i < dir->end && entries[i].name[0] != DELETED_FLAG) {
+        i++;
+    }
+
+    if (i >= dir->capacity) {
+        if (vol->free_count == 0) {
+            errno = ENOSPC;
+            return NULL;
+        }
+        uint32_t last = dir->clusters[dir->nclusters - 1];
+        uint32_t c = grow_chain(vol, last, 1);
+        if (c == 0) {
+            return NULL;
+        }
+        // Either buffer may have moved even if the other could not grow
+        uint32_t *clusters = realloc(dir->clusters, (dir->nclusters + 1) * sizeof(uint32_t));
+        if (clusters != NULL) dir->clusters = clusters;
+        unsigned char *data = realloc(dir->data, (size_t)(dir->nclusters + 1) * CLUSTER_BYTES(vol));
+        if (data != NULL) dir->data = data;
+        int err = ENOMEM;
+        if (clusters != NULL && data != NULL) {
+            memset(dir->data + (size_t)dir->nclusters * CLUSTER_BYTES(vol), 0, CLUSTER_BYTES(vol));
+            err = writecluster(vol, dir->data + (size_t)dir->nclusters * CLUSTER_BYTES(vol), c) != 0 ? errno : 0;
+        }
+        if (err != 0) {
+            set_next_cluster(vol, last, FAT_EOC);
+            free_chain(vol, c);
+            errno = err;
+            return NULL;
+        }
+        uint32_t old_capacity = dir->capacity;
+        dir->clusters[dir->nclusters++] = c;
+        dir->capacity = dir->nclusters * CLUSTER_BYTES(vol) / sizeof(struct msdos_dir_entry);
+        if (dir_build_index(dir) != 0) {
+            dir->nclusters--;
+            dir->capacity = old_capacity;
+            set_next_cluster(vol, last, FAT_EOC);
+            free_chain(vol, c);
+            errno = ENOMEM;
+            return NULL;
+        }
+        entries = (struct msdos_dir_entry *)dir->data;
+        i = dir->end;
+    }
+
+    if (i == dir->end) {
+        dir->end++;
+    }
+    dir->free_hint = i + 1;
+
+    memset(&entries[i], 0, sizeof(struct msdos_dir_entry));
+    memcpy(entries[i].name, name, 11);
+    dir_hash_insert(dir, i);
+    return &entries[i];
+}
+
+// Mark 'entry' deleted and drop it from the index. Not yet written.
+static void dir_remove_entry(struct dir_index *dir, struct msdos_dir_entry *entry) {
+    uint32_t i = entry - (struct msdos_dir_entry *)dir->data;
+    dir_hash_remove(dir, i);
+    entry->name[0] = DELETED_FLAG;
+    if (i < dir->free_hint) dir->free_hint = i;
+}
+
+// Walk every directory of 'path' but the last component. Returns the
+// directory that should hold the last component and stores its 8.3 name
+// in 'name', or NULL with errno set: EINVAL for a component that is not
+// a valid 8.3 name, ENOENT or ENOTDIR for a missing intermediate directory.
+static struct dir_index *resolve_parent(struct fat_volume *vol, const char *path, unsigned char name[11]) {
+    struct dir_index *dir = load_dir(vol, vol->root_cluster);
+    while (*path == '/') path++;
+
+    while (dir != NULL) {
+        const char *slash = strchr(path, '/');
+        size_t len = slash ? (size_t)(slash - path) : strlen(path);
+        if (make_83_name(path, len, name) != 0) {
+            errno = EINVAL;
+            return NULL;
+        }
+
+        const char *rest = slash;
+        while (rest != NULL && *rest == '/') rest++;
+        if (rest == NULL || *rest == '\0') return dir;
+
+        struct msdos_dir_entry *e = dir_lookup(dir, name);
+        if (e == NULL || !(e->attr & ATTR_DIR)) {
+            errno = e == NULL ? ENOENT : ENOTDIR;
+            return NULL;
+        }
+        dir = load_dir(vol, le16toh(e->start) | (le16toh(e->starthi) << 16));
+        path = rest;
+    }
+    return NULL;
+}
+
+// What to call a path resolve_parent() failed on with 'err'
+static const char *resolve_error(int err) {
+    return err == EINVAL ? "Not a valid 8.3 name" : "Invalid path";
+}
+
+// Look a path such as "A/B/FILE.TXT" up through the directory index. The
+// returned entry lives in the cached directory, which is stored in '*dirp'
+// unless 'dirp' is NULL.
+static struct msdos_dir_entry *find_file_entry(struct fat_volume *vol, const char *filename, struct dir_index **dirp) {
+    unsigned char name[11];
+    struct dir_index *dir = resolve_parent(vol, filename, name);
+    if (dirp != NULL) {
+        *dirp = dir;
+    }
+    if (dir == NULL) {
+        return NULL;
+    }
+    return dir_lookup(dir, name);
+}
+
+// log2 of 'value' if it is a power of two in [min, max], otherwise -1
+static int geometry_shift(uint32_t value, uint32_t min, uint32_t max) {
+    if (value < min || value > max || (value & (value - 1)) != 0) return -1;
+    return __builtin_ctz(value);
+}
+
+static int read_boot_sector(struct fat_volume *vol) {
+    // Sector 0 is read at the minimum sector size, before the real one is known
+    unsigned char sector[SECTORSIZE_MAX];
+    if (readsector(vol, sector, 0) != 0) {
+        perror("Failed to read boot sector");
+        return 1;
+    }
+
+    uint32_t bytes_per_sector = *(uint16_t *)(sector + 11);
+    int sshift = geometry_shift(bytes_per_sector, SECTORSIZE_MIN, SECTORSIZE_MAX);
+    int cshift = geometry_shift(sector[13], 1, 128);
+    if (sshift < 0 || cshift < 0 || (bytes_per_sector << cshift) > CLUSTERSIZE_MAX) {
+        fprintf(stderr, "Unsupported geometry: %u bytes per sector, %u sectors per cluster\n",
+                bytes_per_sector, sector[13]);
+        return 1;
+    }
+#ifdef FATMOD_SECTOR_SHIFT
+    if ((unsigned int)sshift != SECTOR_SHIFT(vol)) {
+        fprintf(stderr, "This build only handles %u-byte sectors\n", SECTOR_BYTES(vol));
+        return 1;
+    }
+#else
+    vol->sector_shift = sshift;
+#endif
+#ifdef FATMOD_CLUSTER_SHIFT
+    if ((unsigned int)(sshift + cshift) != CLUSTER_SHIFT(vol)) {
+        fprintf(stderr, "This build only handles %u-byte clusters\n", CLUSTER_BYTES(vol));
+        return 1;
+    }
+#else
+    vol->cluster_shift = sshift + cshift;
+#endif
+
+    // Large clusters get proportionally larger requests, within bounds
+    vol->extent_io_max = CLUSTER_BYTES(vol) * EXTENT_IO_CLUSTERS;
+    if (vol->extent_io_max < EXTENT_IO_MIN) vol->extent_io_max = EXTENT_IO_MIN;
+    if (vol->extent_io_max > EXTENT_IO_MAX) vol->extent_io_max = EXTENT_IO_MAX;
+
+    vol->reserved_sector_count = *(uint16_t *)(sector + 14);
+    vol->num_fats = *(uint8_t *)(sector + 16);
+    vol->sectors_per_fat = *(uint32_t *)(sector + 36);
+    vol->root_cluster_start_sector = vol->reserved_sector_count + (vol->num_fats * vol->sectors_per_fat);
+
+    vol->root_cluster = *(uint32_t *)(sector + 44);
+    vol->fsinfo_sector = *(uint16_t *)(sector + 48);
+
+    vol->total_sectors = *(uint16_t *)(sector + 19);
+    if (vol->total_sectors == 0) {
+        vol->total_sectors = *(uint32_t *)(sector + 32);
+    }
+
+    // Clamp to what both the FAT and the data region can actually address
+    uint64_t fat_entries = ((uint64_t)vol->sectors_per_fat << SECTOR_SHIFT(vol)) / 4;
+    vol->cluster_count = fat_entries > 0x0FFFFFF7 ? 0x0FFFFFF7 : fat_entries;
+    if (vol->total_sectors > vol->root_cluster_start_sector) {
+        uint32_t data_clusters = ((vol->total_sectors - vol->root_cluster_start_sector) >> SPC_SHIFT(vol)) + 2;
+        if (data_clusters < vol->cluster_count) {
+            vol->cluster_count = data_clusters;
+        }
+    }
+    return 0;
+}
+
+static int load_fat(struct fat_volume *vol) {
+    vol->fat_dirty = calloc(vol->sectors_per_fat, 1);
+
+    // With the image mapped, the FAT is used in place and needs no copy,
+    // unless changes are tracked: an edit in the mapping can reach the disk
+    // at any time, before its stamp
+    if (vol->image_map != NULL && vol->changes == NULL) {
+        vol->fat_in_place = TRUE;
+        vol->fat_table = (uint32_t *)map_sectors(vol, NULL, vol->reserved_sector_count, vol->sectors_per_fat);
+        if (vol->fat_table == NULL || vol->fat_dirty == NULL) {
+            fprintf(stderr, "FAT lies outside the disk image\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    vol->fat_table = malloc((size_t)vol->sectors_per_fat << SECTOR_SHIFT(vol));
+    if (vol->fat_table == NULL || vol->fat_dirty == NULL) {
+        perror("Failed to allocate FAT table");
+        return 1;
+    }
+
+    if (read_sectors_parallel(vol, (unsigned char *)vol->fat_table, vol->reserved_sector_count, vol->sectors_per_fat) != 0) {
+        perror("Failed to read FAT");
+        return 1;
+    }
+    return 0;
+}
+
+// Write every dirty run of FAT sectors to each FAT copy in one pass over
+// the dirty flags. When the first FAT is edited in place in the mapping,
+// only the other copies are written.
+static int flush_fat(struct fat_volume *vol) {
+    int first_copy = vol->fat_in_place ? 1 : 0;
+    uint32_t i = 0;
+    while (i < vol->sectors_per_fat) {
+        if (!vol->fat_dirty[i]) {
+            i++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (i + run < vol->sectors_per_fat && vol->fat_dirty[i + run]) {
+            run++;
+        }
+        for (int copy = first_copy; copy < vol->num_fats; copy++) {
+            if (writesectors(vol, (unsigned char *)vol->fat_table + ((size_t)i << SECTOR_SHIFT(vol)),
+                             vol->reserved_sector_count + copy * vol->sectors_per_fat + i, run) != 0) {
+                perror("Failed to write FAT sector");
+                return 1;
+            }
+        }
+        memset(vol->fat_dirty + i, 0, run);
+        i += run;
+    }
+    return 0;
+}
+
+static int build_free_map(struct fat_volume *vol) {
+    vol->free_map = calloc((vol->cluster_count + 63) / 64, sizeof(uint64_t));
+    if (vol->free_map == NULL) {
+        perror("Failed to allocate free cluster map");
+        return 1;
+    }
+
+    vol->free_count = 0;
+    for (uint32_t c = 2; c < vol->cluster_count; c++) {
+        if ((vol->fat_table[c] & 0x0FFFFFFF) == 0) {
+            vol->free_map[c >> 6] |= 1ULL << (c & 63);
+            vol->free_count++;
+        }
+    }
+
+    // Start allocating from the FSInfo next-free hint when it is usable
+    vol->next_free_hint = 2;
+    vol->fsinfo_valid = FALSE;
+    vol->fsinfo_dirty = FALSE;
+    unsigned char info[SECTORSIZE_MAX];
+    if (vol->fsinfo_sector != 0 && vol->fsinfo_sector < vol->reserved_sector_count &&
+        readsector(vol, info, vol->fsinfo_sector) == 0 &&
+        *(uint32_t *)info == FSINFO_LEAD_SIG &&
+        *(uint32_t *)(info + 484) == FSINFO_STRUC_SIG) {
+        vol->fsinfo_valid = TRUE;
+        uint32_t hint = *(uint32_t *)(info + 492);
+        if (hint >= 2 && hint < vol->cluster_count) {
+            vol->next_free_hint = hint;
+        }
+        if (*(uint32_t *)(info + 488) != vol->free_count) {
+            vol->fsinfo_dirty = TRUE;
+        }
+    }
+    return 0;
+}
+
+static int flush_fsinfo(struct fat_volume *vol) {
+    if (!vol->fsinfo_valid || !vol->fsinfo_dirty) return 0;
+
+    unsigned char info[SECTORSIZE_MAX];
+    if (readsector(vol, info, vol->fsinfo_sector) != 0) {
+        perror("Failed to read FSInfo sector");
+        return 1;
+    }
+    *(uint32_t *)(info + 488) = vol->free_count;
+    *(uint32_t *)(info + 492) = vol->next_free_hint < vol->cluster_count ? vol->next_free_hint : FSINFO_UNKNOWN;
+    if (writesector(vol, info, vol->fsinfo_sector) != 0) {
+        perror("Failed to write FSInfo sector");
+        return 1;
+    }
+    vol->fsinfo_dirty = FALSE;
+    return 0;
+}
+// Remember a freed cluster for punch_freed(), extending the last run when
+// the chain continues it. Punching is an optimisation, so running out of
+// memory here just means some space stays allocated on the host.
+static void note_freed_cluster(struct fat_volume *vol, uint32_t cluster) {
+    if (vol->freed_count > 0) {
+        struct extent *last = &vol->freed[vol->freed_count - 1];
+        if (last->start + last->count == cluster) {
+            last->count++;
+            return;
+        }
+    }
+    if (vol->freed_count == vol->freed_cap) {
+        uint32_t cap = vol->freed_cap ? vol->freed_cap * 2 : 64;
+        struct extent *grown = realloc(vol->freed, cap * sizeof(struct extent));
+        if (grown == NULL) return;
+        vol->freed = grown;
+        vol->freed_cap = cap;
+    }
+    vol->freed[vol->freed_count].start = cluster;
+    vol->freed[vol->freed_count].count = 1;
+    vol->freed_count++;
+}
+
+// Deallocate the host blocks behind clusters freed since the last flush,
+// so sparse images shrink. A cluster may have been allocated again since
+// it was freed, so each run is re-checked against the free map.
+static int punch_freed(struct fat_volume *vol) {
+    int result = 0;
+    for (uint32_t i = 0; i < vol->freed_count && result == 0; i++) {
+        uint32_t end = vol->freed[i].start + vol->freed[i].count;
+        uint32_t c = find_free_cluster(vol, vol->freed[i].start);
+        while (c < end) {
+            uint32_t stop = find_used_cluster(vol, c);
+            if (stop > end) stop = end;
+            off_t offset = (off_t)cluster_to_sector(vol, c) << SECTOR_SHIFT(vol);
+            off_t len = (off_t)(stop - c) << CLUSTER_SHIFT(vol);
+            if (image_punch(vol, offset, len) != 0) {
+                if (errno == EOPNOTSUPP) {
+                    fprintf(stderr, "The host file system cannot punch holes; freed space stays allocated\n");
+                    vol->flags &= ~FAT_OPEN_PUNCH_HOLES;
+                } else {
+                    perror("Failed to punch hole");
+                    result = 1;
+                }
+                break;
+            }
+            STAT_ADD(vol, bytes_punched, len);
+            c = find_free_cluster(vol, stop);
+        }
+    }
+    vol->freed_count = 0;
+    return result;
+}
+
+// Free everything a volume holds without committing anything
+static void release_volume(struct fat_volume *vol) {
+    if (vol->image_map != NULL) {
+        munmap(vol->image_map, vol->image_size);
+    }
+    if (!vol->fat_in_place) {
+        free(vol->fat_table);
+    }
+    free(vol->fat_dirty);
+    free(vol->free_map);
+    free(vol->freed);
+    for (int b = 0; b < CACHE_BUCKETS; b++) {
+        while (vol->sector_cache[b] != NULL) {
+            struct cached_sector *cs = vol->sector_cache[b];
+            vol->sector_cache[b] = cs->next;
+            free(cs);
+        }
+    }
+    for (int i = 0; i < CHAIN_CACHE_SIZE; i++) {
+        free_chain_index(&vol->chain_cache[i]);
+    }
+    while (vol->dir_cache != NULL) {
+        struct dir_index *dir = vol->dir_cache;
+        vol->dir_cache = dir->link;
+        free_dir(dir);
+    }
+    overlay_close(vol->overlay);
+    changes_close(vol->changes);
+    packed_close(vol->packed);
+    if (vol->fd >= 0) {
+        close(vol->fd);
+    }
+    while (vol->idle_rings != NULL) {
+        struct io_ring *ring = vol->idle_rings;
+        vol->idle_rings = ring->next;
+        ring_free(ring);
+    }
+    pthread_rwlock_destroy(&vol->lock);
+    pthread_mutex_destroy(&vol->chain_lock);
+    pthread_mutex_destroy(&vol->dir_lock);
+    pthread_mutex_destroy(&vol->ring_lock);
+    free(vol);
+}
+
+struct fat_volume *fat_open(const char *path, int flags) {
+    return fat_open_overlay(path, NULL, flags);
+}
+
+// Attach the change map of the image (or overlay) at 'path': created with
+// FAT_OPEN_TRACK_CHANGES, and picked up whenever it exists, so no write
+// to a tracked image goes unrecorded
+static int track_changes(struct fat_volume *vol, const char *path) {
+    uint64_t size;
+    // A packed image without an overlay never changes
+    if (vol->packed != NULL && vol->overlay == NULL) {
+        return 0;
+    }
+    if (image_length(vol, &size) != 0) {
+        return 1;
+    }
+    int create = (vol->flags & FAT_OPEN_TRACK_CHANGES) != 0;
+    vol->changes = changes_open(path, size, create);
+    if (vol->changes == NULL && (create || errno != ENOENT)) {
+        return 1;
+    }
+    return 0;
+}
+
+struct fat_volume *fat_open_overlay(const char *path, const char *overlay, int flags) {
+    if (overlay != NULL && (flags & FAT_OPEN_MMAP)) {
+        fprintf(stderr, "An overlay cannot be used with a mapped image\n");
+        return NULL;
+    }
+    struct fat_volume *vol = calloc(1, sizeof(*vol));
+    if (vol == NULL) {
+        perror("Failed to allocate volume");
+        return NULL;
+    }
+    vol->flags = flags;
+    vol->sync_each = (flags & FAT_OPEN_SYNC_EACH) != 0;
+    if (flags & FAT_OPEN_IO_SYNC) {
+        vol->io_engine = IO_ENGINE_SYNC;
+    } else if (flags & FAT_OPEN_IO_THREADS) {
+        vol->io_engine = IO_ENGINE_THREADS;
+    } else {
+        vol->io_engine = IO_ENGINE_URING;
+    }
+#ifndef FATMOD_SECTOR_SHIFT
+    vol->sector_shift = 9;
+#endif
+    vol->extent_io_max = EXTENT_IO_MIN;
+    vol->fat_generation = 1;
+    pthread_rwlock_init(&vol->lock, NULL);
+    pthread_mutex_init(&vol->chain_lock, NULL);
+    pthread_mutex_init(&vol->dir_lock, NULL);
+    pthread_mutex_init(&vol->ring_lock, NULL);
+
+    // The base image under an overlay is never written, and neither is a
+    // packed image, which may well be a read-only archive
+    int read_only = overlay != NULL;
+    if (read_only) {
+        vol->fd = open(path, O_RDONLY);
+    } else {
+        vol->fd = open(path, vol->sync_each ? (O_SYNC | O_RDWR) : O_RDWR);
+        if (vol->fd < 0 && (errno == EACCES || errno == EROFS)) {
+            vol->fd = open(path, O_RDONLY);
+            read_only = TRUE;
+        }
+    }
+    int packed = vol->fd >= 0 ? packed_open(vol) : 1;
+    if (vol->fd < 0 || (packed == 1 && read_only && overlay == NULL)) {
+        printf("could not open disk image\n");
+        release_volume(vol);
+        return NULL;
+    }
+    if (packed < 0) {
+        release_volume(vol);
+        return NULL;
+    }
+    if (packed == 0 && (flags & FAT_OPEN_MMAP)) {
+        fprintf(stderr, "A packed image cannot be mapped\n");
+        release_volume(vol);
+        return NULL;
+    }
+    if ((overlay != NULL && overlay_open(vol, path, overlay) != 0) ||
+        track_changes(vol, overlay != NULL ? overlay : path) != 0 ||
+        ((flags & FAT_OPEN_MMAP) && map_image(vol) != 0) ||
+        read_boot_sector(vol) != 0 || load_fat(vol) != 0 || build_free_map(vol) != 0) {
+        release_volume(vol);
+        return NULL;
+    }
+    return vol;
+}
+
+int fat_flush(struct fat_volume *vol) {
+    pthread_rwlock_wrlock(&vol->lock);
+    int result = flush_image(vol);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_close(struct fat_volume *vol) {
+    if (vol == NULL) return 0;
+    int result = fat_flush(vol);
+    release_volume(vol);
+    return result;
+}
+
+int fat_list(struct fat_volume *vol, const char *dir) {
+    pthread_rwlock_rdlock(&vol->lock);
+    int result = list_directory(vol, dir);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_readdir(struct fat_volume *vol, const char *dir, fat_dirent_fn fn, void *arg) {
+    pthread_rwlock_rdlock(&vol->lock);
+    int result = 0;
+    struct dir_index *index = open_directory(vol, dir);
+    if (index == NULL) {
+        result = -1;
+    } else {
+        const struct msdos_dir_entry *dep = (const struct msdos_dir_entry *)index->data;
+        for (uint32_t i = 0; i < index->end && result == 0; ++i, ++dep) {
+            if (entry_is_indexed(dep) && !(dep->attr & ATTR_VOLUME)) {
+                char name[13];
+                format_83_name(dep->name, name);
+                result = fn(name, le32toh(dep->size), (dep->attr & ATTR_DIR) != 0, arg);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_dump(struct fat_volume *vol, const char *path, int format, uint32_t offset, uint32_t len) {
+    pthread_rwlock_rdlock(&vol->lock);
+    int result;
+    if (format == FAT_DUMP_HEX) {
+        result = display_file_binary(vol, path, offset, len);
+    } else if (format == FAT_DUMP_RAW) {
+        result = display_file_raw(vol, path, offset, len);
+    } else {
+        result = display_file_ascii(vol, path, offset, len);
+    }
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+// A packed image opened without an overlay: every change would fail
+int fat_read_only(struct fat_volume *vol) {
+    return vol->packed != NULL && vol->overlay == NULL;
+}
+
+int fat_create(struct fat_volume *vol, const char *path) {
+    pthread_rwlock_wrlock(&vol->lock);
+    int result = create_file(vol, path);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_unlink(struct fat_volume *vol, const char *path) {
+    pthread_rwlock_wrlock(&vol->lock);
+    int result = delete_file(vol, path);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_remove(struct fat_volume *vol, const char *path) {
+    if (fat_read_only(vol)) {
+        errno = EROFS;
+        return -1;
+    }
+    pthread_rwlock_wrlock(&vol->lock);
+    int result = -1;
+    struct dir_index *dir;
+    struct msdos_dir_entry *entry = find_file_entry(vol, path, &dir);
+    if (entry == NULL) {
+        errno = ENOENT;
+    } else if (entry->attr & ATTR_DIR) {
+        errno = EISDIR;
+    } else if (remove_file(vol, dir, entry) == 0) {
+        result = 0;
+    }
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_fill(struct fat_volume *vol, const char *path, int offset, int n, int data) {
+    pthread_rwlock_wrlock(&vol->lock);
+    int result = write_to_file(vol, path, offset, n, data);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_import(struct fat_volume *vol, const char *hostfile, const char *path) {
+    pthread_rwlock_wrlock(&vol->lock);
+    int result = import_file(vol, hostfile, path);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_import_list(struct fat_volume *vol, const char *manifest) {
+    pthread_rwlock_wrlock(&vol->lock);
+    int result = import_list(vol, manifest);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_extract(struct fat_volume *vol, const char *destdir, int nfiles, char *files[]) {
+    pthread_rwlock_rdlock(&vol->lock);
+    int result = extract_files(vol, destdir, nfiles, files);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_pack(struct fat_volume *vol, const char *out) {
+    pthread_rwlock_wrlock(&vol->lock);
+    int result = pack_image(vol, out);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_export_delta(struct fat_volume *vol, uint32_t since, const char *out) {
+    pthread_rwlock_wrlock(&vol->lock);
+    int result = export_delta(vol, since, out);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_commit(struct fat_volume *vol) {
+    pthread_rwlock_wrlock(&vol->lock);
+    int result = commit_overlay(vol);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+int fat_defragment(struct fat_volume *vol) {
+    pthread_rwlock_wrlock(&vol->lock);
+    int result = defragment(vol);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+// Checking alone only reads; repairing rewrites the FAT and entries
+int fat_check(struct fat_volume *vol, int repair) {
+    if (repair) {
+        pthread_rwlock_wrlock(&vol->lock);
+    } else {
+        pthread_rwlock_rdlock(&vol->lock);
+    }
+    int result = check_image(vol, repair);
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+// The handle's directory entry, or NULL (errno ENOENT) once it is deleted
+static struct msdos_dir_entry *file_entry_of(struct fat_file *file) {
+    struct msdos_dir_entry *entry = (struct msdos_dir_entry *)file->dir->data + file->entry;
+    if (!entry_is_indexed(entry)) {
+        errno = ENOENT;
+        return NULL;
+    }
+    return entry;
+}
+
+struct fat_file *fat_file_open(struct fat_volume *vol, const char *path, int flags) {
+    int create = (flags & FAT_FILE_CREATE) != 0;
+    if (create) {
+        pthread_rwlock_wrlock(&vol->lock);
+    } else {
+        pthread_rwlock_rdlock(&vol->lock);
+    }
+
+    unsigned char name[11];
+    struct dir_index *dir = resolve_parent(vol, path, name);
+    struct msdos_dir_entry *entry = dir != NULL ? dir_lookup(dir, name) : NULL;
+    if (dir != NULL) {
+        errno = ENOENT;
+    }
+    if (entry != NULL && (flags & FAT_FILE_EXCL)) {
+        entry = NULL;
+        errno = EEXIST;
+    } else if (entry == NULL && dir != NULL && create) {
+        if (fat_read_only(vol)) {
+            errno = EROFS;
+        } else {
+            entry = add_file_entry(vol, dir, name);
+        }
+    }
+    if (entry != NULL && (entry->attr & ATTR_DIR)) {
+        entry = NULL;
+        errno = EISDIR;
+    }
+
+    struct fat_file *file = NULL;
+    if (entry != NULL && (file = malloc(sizeof(*file))) != NULL) {
+        file->vol = vol;
+        file->dir = dir;
+        file->entry = entry - (struct msdos_dir_entry *)dir->data;
+        file->pos = 0;
+    }
+    pthread_rwlock_unlock(&vol->lock);
+    return file;
+}
+
+// Destination of a fat_file_pread(): the buffer and the file offset of its first byte
+struct read_target {
+    unsigned char *buf;
+    uint32_t base;
+};
+
+static int copy_chunk(const unsigned char *data, size_t len, uint32_t offset, void *arg) {
+    struct read_target *target = arg;
+    memcpy(target->buf + (offset - target->base), data, len);
+    return 0;
+}
+
+ssize_t fat_file_pread(struct fat_file *file, void *buf, size_t len, uint64_t offset) {
+    struct fat_volume *vol = file->vol;
+    pthread_rwlock_rdlock(&vol->lock);
+    ssize_t result = -1;
+    struct msdos_dir_entry *entry = file_entry_of(file);
+    if (entry != NULL) {
+        uint32_t size = le32toh(entry->size);
+        uint32_t start = le16toh(entry->start) | (le16toh(entry->starthi) << 16);
+        struct chain_index *ci = NULL;
+        if (offset >= size || len == 0) {
+            result = 0;
+        } else if ((ci = get_chain_index(vol, start)) == NULL) {
+            errno = EIO;
+        } else {
+            // Stop at the end of the file, or of a chain shorter than its size
+            uint64_t end = offset + len < size ? offset + len : size;
+            uint64_t chain_bytes = (uint64_t)ci->nclusters << CLUSTER_SHIFT(vol);
+            if (end > chain_bytes) end = chain_bytes;
+            struct read_target target = { buf, offset };
+            if (end <= offset) {
+                result = 0;
+            } else if (stream_range(vol, ci, offset, end - offset, copy_chunk, &target) != 0) {
+                errno = EIO;
+            } else {
+                result = end - offset;
+            }
+        }
+        put_chain_index(vol, ci);
+    }
+    pthread_rwlock_unlock(&vol->lock);
+    return result;
+}
+
+ssize_t fat_file_read(struct fat_file *file, void *buf, size_t len) {
+    ssize_t n = fat_file_pread(file, buf, len, file->pos);
+    if (n > 0) {
+        file->pos += n;
+    }
+    return n;
+}
+
+ssize_t fat_file_write(struct fat_file *file, const void *buf, size_t len) {
+    struct fat_volume *vol = file->vol;
+    if (len == 0) return 0;
+    if (fat_read_only(vol)) {
+        errno = EROFS;
+        return -1;
+    }
+    if (file->pos + len > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&vol->lock);
+    int failed = TRUE;
+    struct msdos_dir_entry *entry = file_entry_of(file);
+    if (entry != NULL) {
+        uint32_t size = le32toh(entry->size);
+        failed = FALSE;
+        if (file->pos > size) {
+            // Zero the gap between the old end and the write
+            uint32_t gap = file->pos - size;
+            size_t pattern_len = ((size_t)gap + SECTOR_MASK(vol)) & ~(size_t)SECTOR_MASK(vol);
+            if (pattern_len > vol->extent_io_max) pattern_len = vol->extent_io_max;
+            unsigned char *zeros = calloc(1, pattern_len);
+            failed = zeros == NULL || write_range(vol, file->dir, entry, size, gap, zeros, pattern_len) != 0;
+            free(zeros);
+        }
+        if (!failed) {
+            failed = write_range(vol, file->dir, entry, file->pos, len, buf, 0) != 0;
+        }
+    }
+    if (!failed) {
+        file->pos += len;
+    }
+    pthread_rwlock_unlock(&vol->lock);
+    return failed ? -1 : (ssize_t)len;
+}
+
+int64_t fat_file_seek(struct fat_file *file, int64_t offset, int whence) {
+    int64_t base = 0;
+    if (whence == SEEK_CUR) {
+        base = file->pos;
+    } else if (whence == SEEK_END) {
+        base = fat_file_size(file);
+    } else if (whence != SEEK_SET) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    file->pos = base + offset;
+    return file->pos;
+}
+
+uint32_t fat_file_size(struct fat_file *file) {
+    pthread_rwlock_rdlock(&file->vol->lock);
+    struct msdos_dir_entry *entry = file_entry_of(file);
+    uint32_t size = entry != NULL ? le32toh(entry->size) : 0;
+    pthread_rwlock_unlock(&file->vol->lock);
+    return size;
+}
+
+void fat_file_close(struct fat_file *file) {
+    free(file);
+}
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+// Synthetic FAT32 image generator for the benchmarks. Formats an image
+// the way fatmod expects it and can fill the root directory with files
+// whose cluster chains are split into a chosen number of extents.
+
+#define SECTORSIZE_MAX 4096
+#define RESERVED_SECTORS 32
+#define NUM_FATS 2
+#define FSINFO_SECTOR 1
+#define BACKUP_BOOT_SECTOR 6
+#define FAT_EOC_MARK 0x0FFFFFFF
+#define ROOT_CLUSTER 2
+
+unsigned int sector_size = 512;
+unsigned int sectors_per_cluster = 2;
+uint32_t cluster_size;
+uint32_t total_sectors;
+uint32_t sectors_per_fat;
+uint32_t data_start;              // first sector of cluster 2
+uint32_t cluster_count;           // addressable clusters + 2
+uint32_t *fat;
+uint32_t next_cluster = ROOT_CLUSTER + 1;
+
+void print_help();
+int write_at(int fd, const void *buf, size_t len, off_t offset);
+void format_image(int fd);
+void populate(int fd, int nfiles, uint32_t file_size, int extents);
+
+
+int main(int argc, char *argv[])
+{
+    int nfiles = 0;
+    uint32_t file_size = 0;
+    int extents = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:s:n:z:f:h")) != -1) {
+        switch (opt) {
+        case 'b': sector_size = atoi(optarg); break;
+        case 's': sectors_per_cluster = atoi(optarg); break;
+        case 'n': nfiles = atoi(optarg); break;
+        case 'z': file_size = strtoul(optarg, NULL, 10); break;
+        case 'f': extents = atoi(optarg); break;
+        default:
+            print_help();
+            return 1;
+        }
+    }
+    if (argc - optind < 2 || sectors_per_cluster == 0 || (sectors_per_cluster & (sectors_per_cluster - 1)) ||
+        sectors_per_cluster > 128 || extents < 1 ||
+        sector_size < 512 || sector_size > SECTORSIZE_MAX || (sector_size & (sector_size - 1)) ||
+        sector_size * sectors_per_cluster > 65536) {
+        print_help();
+        return 1;
+    }
+
+    uint64_t size_mb = strtoull(argv[optind + 1], NULL, 10);
+    total_sectors = size_mb * 1024 * 1024 / sector_size;
+    cluster_size = sectors_per_cluster * sector_size;
+
+    // Size the FAT for the clusters that fit next to it
+    uint32_t clusters = (total_sectors - RESERVED_SECTORS) / sectors_per_cluster;
+    sectors_per_fat = ((uint64_t)(clusters + 2) * 4 + sector_size - 1) / sector_size;
+    data_start = RESERVED_SECTORS + NUM_FATS * sectors_per_fat;
+    cluster_count = (total_sectors - data_start) / sectors_per_cluster + 2;
+    if (size_mb == 0 || total_sectors <= data_start + sectors_per_cluster) {
+        printf("Image too small for %u-byte clusters\n", cluster_size);
+        return 1;
+    }
+    if (cluster_count < 65525 + 2) {
+        fprintf(stderr, "warning: %u clusters is below the FAT32 minimum; "
+                "other tools may not mount this image\n", cluster_count - 2);
+    }
+
+    int fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("could not create disk image\n");
+        return 1;
+    }
+    if (ftruncate(fd, (off_t)total_sectors * sector_size) != 0) {
+        perror("Failed to size disk image");
+        return 1;
+    }
+
+    fat = calloc(sectors_per_fat, sector_size);
+    if (fat == NULL) {
+        perror("Failed to allocate FAT");
+        return 1;
+    }
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = FAT_EOC_MARK;
+    fat[ROOT_CLUSTER] = FAT_EOC_MARK;
+
+    if (nfiles > 0) {
+        populate(fd, nfiles, file_size, extents);
+    }
+    format_image(fd);
+
+    close(fd);
+    return 0;
+}
+
+void print_help() {
+    printf("Usage: mkfatimg [options] IMAGE SIZE_MB\n");
+    printf("Options:\n");
+    printf("  -b BYTES   Bytes per sector: 512, 1024, 2048 or 4096 (default 512)\n");
+    printf("  -s N       Sectors per cluster (power of two, default 2)\n");
+    printf("  -n N       Create N files in the root directory\n");
+    printf("  -z BYTES   Size of every created file\n");
+    printf("  -f N       Split every file's chain into N interleaved extents\n");
+}
+
+int write_at(int fd, const void *buf, size_t len, off_t offset) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0) {
+            perror("Failed to write disk image");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static unsigned int cluster_to_sector(uint32_t c) {
+    return data_start + (c - 2) * sectors_per_cluster;
+}
+
+// Boot sector, FSInfo, backup boot sector and every FAT copy
+void format_image(int fd) {
+    unsigned char boot[SECTORSIZE_MAX] = { 0 };
+    boot[0] = 0xEB; boot[1] = 0x58; boot[2] = 0x90;
+    memcpy(boot + 3, "MKFATIMG", 8);
+    *(uint16_t *)(boot + 11) = sector_size;
+    boot[13] = sectors_per_cluster;
+    *(uint16_t *)(boot + 14) = RESERVED_SECTORS;
+    boot[16] = NUM_FATS;
+    boot[21] = 0xF8;                                   // media descriptor
+    *(uint16_t *)(boot + 24) = 63;                     // sectors per track
+    *(uint16_t *)(boot + 26) = 255;                    // heads
+    *(uint32_t *)(boot + 32) = total_sectors;
+    *(uint32_t *)(boot + 36) = sectors_per_fat;
+    *(uint32_t *)(boot + 44) = ROOT_CLUSTER;
+    *(uint16_t *)(boot + 48) = FSINFO_SECTOR;
+    *(uint16_t *)(boot + 50) = BACKUP_BOOT_SECTOR;
+    boot[64] = 0x80;                                   // drive number
+    boot[66] = 0x29;                                   // extended boot signature
+    memcpy(boot + 71, "BENCH      ", 11);
+    memcpy(boot + 82, "FAT32   ", 8);
+    boot[510] = 0x55;
+    boot[511] = 0xAA;
+    write_at(fd, boot, sector_size, 0);
+    write_at(fd, boot, sector_size, (off_t)BACKUP_BOOT_SECTOR * sector_size);
+
+    uint32_t free_clusters = 0;
+    for (uint32_t c = 2; c < cluster_count; c++) {
+        if (fat[c] == 0) free_clusters++;
+    }
+    unsigned char info[SECTORSIZE_MAX] = { 0 };
+    *(uint32_t *)(info + 0) = 0x41615252;
+    *(uint32_t *)(info + 484) = 0x61417272;
+    *(uint32_t *)(info + 488) = free_clusters;
+    *(uint32_t *)(info + 492) = next_cluster;
+    *(uint32_t *)(info + 508) = 0xAA550000;
+    write_at(fd, info, sector_size, (off_t)FSINFO_SECTOR * sector_size);
+
+    for (int copy = 0; copy < NUM_FATS; copy++) {
+        write_at(fd, fat, (size_t)sectors_per_fat * sector_size,
+                 (off_t)(RESERVED_SECTORS + copy * sectors_per_fat) * sector_size);
+    }
+}
+
+// Create F0000001.DAT ... in the root directory. Files are allocated in
+// 'extents' rounds; each round hands every file its next slice of
+// clusters, so the slices of different files interleave on disk.
+void populate(int fd, int nfiles, uint32_t file_size, int extents) {
+    uint32_t per_file = (file_size + cluster_size - 1) / cluster_size;
+    uint64_t needed = (uint64_t)per_file * nfiles + (uint64_t)nfiles * 32 / cluster_size + 1;
+    if (needed + ROOT_CLUSTER + 1 > cluster_count) {
+        printf("Files do not fit in the image\n");
+        exit(1);
+    }
+
+    uint32_t *first = calloc(nfiles, sizeof(uint32_t));
+    uint32_t *last = calloc(nfiles, sizeof(uint32_t));
+    uint32_t *have = calloc(nfiles, sizeof(uint32_t));
+    unsigned char *buffer = malloc(cluster_size);
+    if (first == NULL || last == NULL || have == NULL || buffer == NULL) {
+        perror("Failed to allocate file table");
+        exit(1);
+    }
+
+    uint32_t slice = (per_file + extents - 1) / extents;
+    for (int round = 0; round < extents; round++) {
+        for (int f = 0; f < nfiles; f++) {
+            for (uint32_t i = 0; i < slice && have[f] < per_file; i++) {
+                uint32_t c = next_cluster++;
+                if (last[f] != 0) fat[last[f]] = c;
+                else first[f] = c;
+                fat[c] = FAT_EOC_MARK;
+                last[f] = c;
+
+                // Deterministic content: file number and cluster index
+                memset(buffer, (f + have[f]) & 0xFF, cluster_size);
+                write_at(fd, buffer, cluster_size, (off_t)cluster_to_sector(c) * sector_size);
+                have[f]++;
+            }
+        }
+    }
+
+    // Root directory entries, growing the root chain cluster by cluster
+    uint32_t entries_per_cluster = cluster_size / 32;
+    uint32_t dir_cluster = ROOT_CLUSTER;
+    memset(buffer, 0, cluster_size);
+    for (int f = 0; f < nfiles; f++) {
+        unsigned char *e = buffer + (f % entries_per_cluster) * 32;
+        char name[12];
+        snprintf(name, sizeof(name), "F%07dDAT", (f + 1) % 10000000);
+        memcpy(e, name, 11);
+        e[11] = 0x20;                                  // archive
+        *(uint16_t *)(e + 20) = first[f] >> 16;
+        *(uint16_t *)(e + 26) = first[f] & 0xFFFF;
+        *(uint32_t *)(e + 28) = file_size;
+
+        if ((f + 1) % entries_per_cluster == 0 || f == nfiles - 1) {
+            write_at(fd, buffer, cluster_size, (off_t)cluster_to_sector(dir_cluster) * sector_size);
+            memset(buffer, 0, cluster_size);
+            if (f != nfiles - 1) {
+                uint32_t c = next_cluster++;
+                fat[dir_cluster] = c;
+                fat[c] = FAT_EOC_MARK;
+                dir_cluster = c;
+            }
+        }
+    }
+    // A full last cluster still needs an end-of-directory marker after it
+    if (nfiles % entries_per_cluster == 0) {
+        uint32_t c = next_cluster++;
+        fat[dir_cluster] = c;
+        fat[c] = FAT_EOC_MARK;
+        write_at(fd, buffer, cluster_size, (off_t)cluster_to_sector(c) * sector_size);
+    }
+
+    free(first);
+    free(last);
+    free(have);
+    free(buffer);
+}